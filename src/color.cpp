@@ -0,0 +1,278 @@
+/* color.cpp
+ * Implementation of the color space conversions declared in color.h.
+ * sRGB decoding and encoding go through lookup tables, YCbCr uses 16-bit
+ * fixed point, and every conversion is split across threads by rows
+ */
+
+#include "color.h"
+
+#include <algorithm>
+#include <cmath>
+#include "parallel.h"
+
+namespace agl {
+
+FloatImage::FloatImage() {  }
+
+FloatImage::FloatImage(int width, int height): _width(width),
+    _height(height), _data(width * height * 3, 0.0f) {  }
+
+int FloatImage::width() const {
+  return _width;
+}
+
+int FloatImage::height() const {
+  return _height;
+}
+
+float* FloatImage::data() {
+  return _data.data();
+}
+
+const float* FloatImage::data() const {
+  return _data.data();
+}
+
+// entries in the linear -> sRGB table; fine enough that every 8-bit
+// result matches the exact curve, even in the steep dark end
+static const int kEncodeSize = 1 << 14;
+
+static const float* decodeTable() {
+  static std::vector<float> table = [] {
+    std::vector<float> values(256);
+    for (int k = 0; k < 256; k++) {
+      float c = k / 255.0f;
+      values[k] = c <= 0.04045f ? c / 12.92f :
+          pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+    return values;
+  }();
+  return table.data();
+}
+
+static const unsigned char* encodeTable() {
+  static std::vector<unsigned char> table = [] {
+    std::vector<unsigned char> values(kEncodeSize);
+    for (int k = 0; k < kEncodeSize; k++) {
+      float c = (float) k / (kEncodeSize - 1);
+      float s = c <= 0.0031308f ? c * 12.92f :
+          1.055f * pow(c, 1.0f / 2.4f) - 0.055f;
+      values[k] = (unsigned char) std::min(std::max(s * 255.0f + 0.5f, 0.0f),
+          255.0f);
+    }
+    return values;
+  }();
+  return table.data();
+}
+
+float srgbToLinear(unsigned char value) {
+  return decodeTable()[value];
+}
+
+unsigned char linearToSrgb(float value) {
+  value = std::min(std::max(value, 0.0f), 1.0f);
+  return encodeTable()[(int) (value * (kEncodeSize - 1) + 0.5f)];
+}
+
+FloatImage srgbToLinear(const Image& image) {
+  FloatImage result(image.width(), image.height());
+  const unsigned char* src = (const unsigned char*) image.data();
+  float* dst = result.data();
+  const float* table = decodeTable();
+  int rowBytes = image.width() * 3;
+  parallelFor(image.height(), [=](int begin, int end) {
+    for (int k = begin * rowBytes; k < end * rowBytes; k++) {
+      dst[k] = table[src[k]];
+    }
+  });
+  return result;
+}
+
+Image linearToSrgb(const FloatImage& image) {
+  Image result(image.width(), image.height());
+  const float* src = image.data();
+  unsigned char* dst = (unsigned char*) result.data();
+  int rowBytes = image.width() * 3;
+  encodeTable();  // build the table before the threads start
+  parallelFor(image.height(), [=](int begin, int end) {
+    for (int k = begin * rowBytes; k < end * rowBytes; k++) {
+      dst[k] = linearToSrgb(src[k]);
+    }
+  });
+  return result;
+}
+
+FloatImage rgbToHsv(const Image& image) {
+  FloatImage result(image.width(), image.height());
+  const unsigned char* src = (const unsigned char*) image.data();
+  float* dst = result.data();
+  int width = image.width();
+  parallelFor(image.height(), [=](int begin, int end) {
+    for (int k = begin * width; k < end * width; k++) {
+      float r = src[k * 3] / 255.0f;
+      float g = src[k * 3 + 1] / 255.0f;
+      float b = src[k * 3 + 2] / 255.0f;
+      float max = std::max(r, std::max(g, b));
+      float min = std::min(r, std::min(g, b));
+      float delta = max - min;
+      float hue = 0.0f;
+      if (delta > 0.0f) {
+        if (max == r) {
+          hue = 60.0f * fmod((g - b) / delta + 6.0f, 6.0f);
+        } else if (max == g) {
+          hue = 60.0f * ((b - r) / delta + 2.0f);
+        } else {
+          hue = 60.0f * ((r - g) / delta + 4.0f);
+        }
+      }
+      dst[k * 3] = hue;
+      dst[k * 3 + 1] = max > 0.0f ? delta / max : 0.0f;
+      dst[k * 3 + 2] = max;
+    }
+  });
+  return result;
+}
+
+Image hsvToRgb(const FloatImage& image) {
+  Image result(image.width(), image.height());
+  const float* src = image.data();
+  unsigned char* dst = (unsigned char*) result.data();
+  int width = image.width();
+  parallelFor(image.height(), [=](int begin, int end) {
+    for (int k = begin * width; k < end * width; k++) {
+      float hue = fmod(fmod(src[k * 3], 360.0f) + 360.0f, 360.0f) / 60.0f;
+      float saturation = std::min(std::max(src[k * 3 + 1], 0.0f), 1.0f);
+      float value = std::min(std::max(src[k * 3 + 2], 0.0f), 1.0f);
+      float chroma = value * saturation;
+      float x = chroma * (1.0f - fabs(fmod(hue, 2.0f) - 1.0f));
+      float m = value - chroma;
+      float r = 0.0f, g = 0.0f, b = 0.0f;
+      switch ((int) hue) {
+        case 0: r = chroma; g = x; break;
+        case 1: r = x; g = chroma; break;
+        case 2: g = chroma; b = x; break;
+        case 3: g = x; b = chroma; break;
+        case 4: r = x; b = chroma; break;
+        default: r = chroma; b = x; break;
+      }
+      dst[k * 3] = (unsigned char) ((r + m) * 255.0f + 0.5f);
+      dst[k * 3 + 1] = (unsigned char) ((g + m) * 255.0f + 0.5f);
+      dst[k * 3 + 2] = (unsigned char) ((b + m) * 255.0f + 0.5f);
+    }
+  });
+  return result;
+}
+
+static inline unsigned char clampByte(int value) {
+  return (unsigned char) (value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+// JPEG (BT.601 full range) matrices in 16.16 fixed point; each row of the
+// forward matrix sums to 65536 (Y) or 0 (Cb, Cr) so gray stays gray
+Image rgbToYCbCr(const Image& image) {
+  Image result(image.width(), image.height());
+  const unsigned char* src = (const unsigned char*) image.data();
+  unsigned char* dst = (unsigned char*) result.data();
+  int width = image.width();
+  parallelFor(image.height(), [=](int begin, int end) {
+    const int half = 1 << 15;
+    const int offset = (128 << 16) + half;
+    for (int k = begin * width; k < end * width; k++) {
+      int r = src[k * 3];
+      int g = src[k * 3 + 1];
+      int b = src[k * 3 + 2];
+      dst[k * 3] = clampByte((19595 * r + 38470 * g + 7471 * b + half) >> 16);
+      dst[k * 3 + 1] = clampByte((-11059 * r - 21709 * g + 32768 * b +
+          offset) >> 16);
+      dst[k * 3 + 2] = clampByte((32768 * r - 27439 * g - 5329 * b +
+          offset) >> 16);
+    }
+  });
+  return result;
+}
+
+Image yCbCrToRgb(const Image& image) {
+  Image result(image.width(), image.height());
+  const unsigned char* src = (const unsigned char*) image.data();
+  unsigned char* dst = (unsigned char*) result.data();
+  int width = image.width();
+  parallelFor(image.height(), [=](int begin, int end) {
+    const int half = 1 << 15;
+    for (int k = begin * width; k < end * width; k++) {
+      int y = (src[k * 3] << 16) + half;
+      int cb = src[k * 3 + 1] - 128;
+      int cr = src[k * 3 + 2] - 128;
+      dst[k * 3] = clampByte((y + 91881 * cr) >> 16);
+      dst[k * 3 + 1] = clampByte((y - 22554 * cb - 46802 * cr) >> 16);
+      dst[k * 3 + 2] = clampByte((y + 116130 * cb) >> 16);
+    }
+  });
+  return result;
+}
+
+// D65 reference white
+static const float kWhiteX = 0.95047f;
+static const float kWhiteZ = 1.08883f;
+
+static inline float labForward(float t) {
+  const float epsilon = 216.0f / 24389.0f;  // (6/29)^3
+  return t > epsilon ? cbrt(t) : t * (24389.0f / 27.0f / 116.0f) +
+      16.0f / 116.0f;
+}
+
+static inline float labInverse(float t) {
+  const float delta = 6.0f / 29.0f;
+  return t > delta ? t * t * t : 3.0f * delta * delta * (t - 4.0f / 29.0f);
+}
+
+FloatImage rgbToLab(const Image& image) {
+  FloatImage result(image.width(), image.height());
+  const unsigned char* src = (const unsigned char*) image.data();
+  float* dst = result.data();
+  const float* table = decodeTable();
+  int width = image.width();
+  parallelFor(image.height(), [=](int begin, int end) {
+    for (int k = begin * width; k < end * width; k++) {
+      float r = table[src[k * 3]];
+      float g = table[src[k * 3 + 1]];
+      float b = table[src[k * 3 + 2]];
+      float x = (0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / kWhiteX;
+      float y = 0.2126729f * r + 0.7151522f * g + 0.0721750f * b;
+      float z = (0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / kWhiteZ;
+      float fx = labForward(x);
+      float fy = labForward(y);
+      float fz = labForward(z);
+      dst[k * 3] = 116.0f * fy - 16.0f;
+      dst[k * 3 + 1] = 500.0f * (fx - fy);
+      dst[k * 3 + 2] = 200.0f * (fy - fz);
+    }
+  });
+  return result;
+}
+
+Image labToRgb(const FloatImage& image) {
+  Image result(image.width(), image.height());
+  const float* src = image.data();
+  unsigned char* dst = (unsigned char*) result.data();
+  int width = image.width();
+  encodeTable();  // build the table before the threads start
+  parallelFor(image.height(), [=](int begin, int end) {
+    for (int k = begin * width; k < end * width; k++) {
+      float fy = (src[k * 3] + 16.0f) / 116.0f;
+      float fx = fy + src[k * 3 + 1] / 500.0f;
+      float fz = fy - src[k * 3 + 2] / 200.0f;
+      float x = labInverse(fx) * kWhiteX;
+      float y = labInverse(fy);
+      float z = labInverse(fz) * kWhiteZ;
+      dst[k * 3] = linearToSrgb(3.2404542f * x - 1.5371385f * y -
+          0.4985314f * z);
+      dst[k * 3 + 1] = linearToSrgb(-0.9692660f * x + 1.8760108f * y +
+          0.0415560f * z);
+      dst[k * 3 + 2] = linearToSrgb(0.0556434f * x - 0.2040259f * y +
+          1.0572252f * z);
+    }
+  });
+  return result;
+}
+
+}  // namespace agl
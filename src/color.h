@@ -0,0 +1,71 @@
+/* color.h
+ * Conversions of whole images between sRGB and other color spaces: linear
+ * light RGB, HSV, YCbCr and CIELAB. Every conversion has a matching inverse
+ */
+
+#ifndef AGL_COLOR_H_
+#define AGL_COLOR_H_
+
+#include <vector>
+#include "image.h"
+
+namespace agl {
+
+/**
+ * @brief Image with one float per channel (3 channels, interleaved)
+ *
+ * Holds color values that do not fit in 8 bits, e.g. linear light RGB,
+ * HSV or CIELAB
+ */
+class FloatImage {
+ public:
+  FloatImage();
+  FloatImage(int width, int height);  // all channels start at zero
+
+  /** @brief Return the image width in pixels
+   */
+  int width() const;
+
+  /** @brief Return the image height in pixels
+   */
+  int height() const;
+
+  /**
+   * @brief Return the channel data
+   *
+   * Data has size width * height * 3
+   */
+  float* data();
+  const float* data() const;
+
+ private:
+  int _width = 0;
+  int _height = 0;
+  std::vector<float> _data;
+};
+
+// decode one sRGB value to linear light in [0, 1] (table lookup)
+float srgbToLinear(unsigned char value);
+
+// encode a linear light value (clamped to [0, 1]) as sRGB (table lookup)
+unsigned char linearToSrgb(float value);
+
+// sRGB <-> linear light RGB in [0, 1]
+FloatImage srgbToLinear(const Image& image);
+Image linearToSrgb(const FloatImage& image);
+
+// sRGB <-> HSV with hue in degrees [0, 360), saturation and value in [0, 1]
+FloatImage rgbToHsv(const Image& image);
+Image hsvToRgb(const FloatImage& image);
+
+// sRGB <-> full range YCbCr (JPEG / BT.601), stored in the r, g, b
+// channels of an Image as (Y, Cb, Cr)
+Image rgbToYCbCr(const Image& image);
+Image yCbCrToRgb(const Image& image);
+
+// sRGB <-> CIELAB (D65 white), L in [0, 100]
+FloatImage rgbToLab(const Image& image);
+Image labToRgb(const FloatImage& image);
+
+}  // namespace agl
+#endif  // AGL_COLOR_H_
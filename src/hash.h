@@ -0,0 +1,101 @@
+/* hash.h
+ * 64-bit xxHash (XXH64) for hashing pixel data
+ */
+
+#ifndef AGL_HASH_H_
+#define AGL_HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace agl {
+
+namespace xxh64 {
+
+static const uint64_t kPrime1 = 11400714785074694791ULL;
+static const uint64_t kPrime2 = 14029467366897019727ULL;
+static const uint64_t kPrime3 = 1609587929392839161ULL;
+static const uint64_t kPrime4 = 9650029242287828579ULL;
+static const uint64_t kPrime5 = 2870177450012600261ULL;
+
+inline uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const unsigned char* p) {
+  uint64_t value;
+  memcpy(&value, p, 8);  // assumes a little endian host
+  return value;
+}
+
+inline uint32_t read32(const unsigned char* p) {
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input) {
+  acc += input * kPrime2;
+  return rotl(acc, 31) * kPrime1;
+}
+
+inline uint64_t merge(uint64_t acc, uint64_t value) {
+  acc ^= round(0, value);
+  return acc * kPrime1 + kPrime4;
+}
+
+}  // namespace xxh64
+
+// XXH64 of length bytes; fast enough to run over every loaded image
+inline uint64_t hash64(const void* data, size_t length, uint64_t seed = 0) {
+  using namespace xxh64;
+  const unsigned char* p = (const unsigned char*) data;
+  const unsigned char* end = p + length;
+  uint64_t h;
+  if (length >= 32) {
+    // four independent lanes over 32 byte stripes
+    uint64_t v1 = seed + kPrime1 + kPrime2;
+    uint64_t v2 = seed + kPrime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - kPrime1;
+    const unsigned char* limit = end - 32;
+    do {
+      v1 = xxh64::round(v1, read64(p));
+      v2 = xxh64::round(v2, read64(p + 8));
+      v3 = xxh64::round(v3, read64(p + 16));
+      v4 = xxh64::round(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge(h, v1);
+    h = merge(h, v2);
+    h = merge(h, v3);
+    h = merge(h, v4);
+  } else {
+    h = seed + kPrime5;
+  }
+  h += (uint64_t) length;
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh64::round(0, read64(p));
+    h = rotl(h, 27) * kPrime1 + kPrime4;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t) read32(p) * kPrime1;
+    h = rotl(h, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= (*p) * kPrime5;
+    h = rotl(h, 11) * kPrime1;
+  }
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h;
+}
+
+}  // namespace agl
+#endif  // AGL_HASH_H_
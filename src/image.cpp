@@ -15,6 +15,11 @@
 #include "image.h"
 
 #include <cassert>
+#include <mutex>
+#include "color.h"
+#include "hash.h"
+#include "kernels.h"
+#include "parallel.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
 #define STB_IMAGE_IMPLEMENTATION
@@ -53,6 +58,12 @@ Image::Image(const Image& orig) {
   _width = orig._width;
   _height = orig._height;
   _components = orig._components;
+  _palette = orig._palette;
+  _indices = orig._indices;
+  _indicesHash = orig._indicesHash;
+  _dirty = orig._dirty;
+  _hash = orig._hash;
+  _hashValid = orig._hashValid;
   _pixels = new struct Pixel[_width * _height];
   memcpy(_pixels, orig._pixels, sizeof(struct Pixel) * _width * _height);
 }
@@ -65,6 +76,12 @@ Image& Image::operator=(const Image& orig) {
   _width = orig._width;
   _height = orig._height;
   _components = orig._components;
+  _palette = orig._palette;
+  _indices = orig._indices;
+  _indicesHash = orig._indicesHash;
+  _dirty = orig._dirty;
+  _hash = orig._hash;
+  _hashValid = orig._hashValid;
   _pixels = new struct Pixel[_width * _height];
   memcpy(_pixels, orig._pixels, sizeof(struct Pixel) * _width * _height);
   return *this;
@@ -75,6 +92,16 @@ Image::~Image() {
   resetPixels();
 }
 
+uint64_t Image::hash() const {
+  if (!_hashValid) {
+    // the size goes into the seed, so e.g. 2x8 and 4x4 images differ
+    uint64_t seed = ((uint64_t) _width << 32) | (uint32_t) _height;
+    _hash = hash64(_pixels, sizeof(struct Pixel) * _width * _height, seed);
+    _hashValid = true;
+  }
+  return _hash;
+}
+
 int Image::width() const {
   return _width;
 }
@@ -83,16 +110,27 @@ int Image::height() const {
   return _height;
 }
 
-char* Image::data() const {
+char* Image::data() {
+  _hashValid = false;  // the caller may write through it
   return (char *) _pixels;
 }
 
+const char* Image::data() const {
+  return (const char *) _pixels;
+}
+
 void Image::set(int width, int height, unsigned char* data) {
   resetPixels();
+  _palette.clear();
+  _indices.clear();
+  _hashValid = false;
   _width = width;
   _height = height;
   _pixels = new struct Pixel[_width * _height];
   memcpy(_pixels, data, sizeof(struct Pixel) * _width * _height);
+  // every pixel may have changed
+  _dirty.clear();
+  markDirty(0, 0, _width, _height);
 }
 
 bool Image::load(const std::string& filename, bool flip) {
@@ -101,22 +139,30 @@ bool Image::load(const std::string& filename, bool flip) {
   stbi_set_flip_vertically_on_load(flip);
   // free pixel memory first
   resetPixels();
+  _palette.clear();
+  _indices.clear();
+  _dirty.clear();  // a freshly loaded image has no changes yet
   // stbi_load returns unsigned char *, so must cast to struct Pixel *
   // also must convert filename from string to char *
   // requesting only 3 channels (RGB)
   _pixels = (struct Pixel *) stbi_load(filename.c_str(), &_width, &_height,
       &_components, 3);
   _use_stbi_free = true;
+  _hashValid = false;
   if (_pixels == NULL) {
     // allocation failure
     return false;
   } else {
-    // successful load
+    // successful load; hash now while the pixels are still in cache
+    hash();
     return true;
   }
 }
 
 bool Image::save(const std::string& filename, bool flip) const {
+  if (!_palette.empty() && saveIndexed(filename, flip)) {
+    return true;
+  }
   // if flip = true, will set stbi's flip variable to true also
   stbi_flip_vertically_on_write(flip);
   int result = stbi_write_png(filename.c_str(), _width, _height, 3,
@@ -130,20 +176,109 @@ bool Image::save(const std::string& filename, bool flip) const {
   }
 }
 
-Pixel Image::get(int row, int col) const {
-  return _pixels[row * _width + col];
+// PNG chunk checksum (CRC-32, as in the PNG specification)
+static uint32_t pngCrc(const unsigned char* data, size_t length,
+    uint32_t crc = 0xFFFFFFFFu) {
+  static std::vector<uint32_t> table = [] {
+    std::vector<uint32_t> values(256);
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      values[n] = c;
+    }
+    return values;
+  }();
+  for (size_t k = 0; k < length; k++) {
+    crc = table[(crc ^ data[k]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
 }
 
-void Image::set(int row, int col, const Pixel& color) {
-  _pixels[row * _width + col] = color;
+static void writePngChunk(FILE* file, const char* type,
+    const unsigned char* data, uint32_t length) {
+  unsigned char header[8] = {(unsigned char) (length >> 24),
+      (unsigned char) (length >> 16), (unsigned char) (length >> 8),
+      (unsigned char) length, (unsigned char) type[0],
+      (unsigned char) type[1], (unsigned char) type[2],
+      (unsigned char) type[3]};
+  uint32_t crc = pngCrc(header + 4, 4);
+  crc = pngCrc(data, length, crc) ^ 0xFFFFFFFFu;
+  unsigned char footer[4] = {(unsigned char) (crc >> 24),
+      (unsigned char) (crc >> 16), (unsigned char) (crc >> 8),
+      (unsigned char) crc};
+  fwrite(header, 1, 8, file);
+  if (length > 0) {  // IEND has no data (and a NULL pointer)
+    fwrite(data, 1, length, file);
+  }
+  fwrite(footer, 1, 4, file);
 }
 
-Pixel Image::get(int i) const {
-  return _pixels[i];
+bool Image::saveIndexed(const std::string& filename, bool flip) const {
+  if (_palette.empty() || _palette.size() > 256 ||
+      _indices.size() != (size_t) _width * _height) {
+    return false;
+  }
+  if (hash() != _indicesHash) {
+    return false;  // edited since quantize, write as RGB instead
+  }
+  // scanlines are one filter byte (0 = none) followed by the indices
+  int stride = _width + 1;
+  std::vector<unsigned char> scanlines(stride * _height);
+  for (int i = 0; i < _height; i++) {
+    unsigned char* line = scanlines.data() + i * stride;
+    line[0] = 0;
+    memcpy(line + 1, _indices.data() + (flip ? _height - 1 - i : i) * _width,
+        _width);
+  }
+  int compressedLength = 0;
+  unsigned char* compressed = stbi_zlib_compress(scanlines.data(),
+      (int) scanlines.size(), &compressedLength, 8);
+  if (compressed == NULL) {
+    return false;
+  }
+  FILE* file = fopen(filename.c_str(), "wb");
+  if (file == NULL) {
+    STBIW_FREE(compressed);
+    return false;
+  }
+  static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  fwrite(signature, 1, 8, file);
+  // width, height, bit depth 8, color type 3 (palette), no interlace
+  unsigned char header[13] = {(unsigned char) (_width >> 24),
+      (unsigned char) (_width >> 16), (unsigned char) (_width >> 8),
+      (unsigned char) _width, (unsigned char) (_height >> 24),
+      (unsigned char) (_height >> 16), (unsigned char) (_height >> 8),
+      (unsigned char) _height, 8, 3, 0, 0, 0};
+  writePngChunk(file, "IHDR", header, 13);
+  writePngChunk(file, "PLTE", (const unsigned char*) _palette.data(),
+      (uint32_t) _palette.size() * 3);
+  writePngChunk(file, "IDAT", compressed, compressedLength);
+  writePngChunk(file, "IEND", NULL, 0);
+  STBIW_FREE(compressed);
+  bool ok = ferror(file) == 0;
+  ok = fclose(file) == 0 && ok;
+  return ok;
 }
 
-void Image::set(int i, const Pixel& c) {
-  _pixels[i] = c;
+void Image::forEachRow(
+    const std::function<void(int, PixelSpan<Pixel>)>& fn) {
+  _hashValid = false;
+  parallelFor(_height, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      fn(y, PixelSpan<Pixel>(_pixels + y * _width, _width));
+    }
+  });
+}
+
+void Image::forEachRow(
+    const std::function<void(int, PixelSpan<const Pixel>)>& fn) const {
+  parallelFor(_height, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      fn(y, PixelSpan<const Pixel>(_pixels + y * _width, _width));
+    }
+  });
 }
 
 Image Image::resize(int w, int h) const {
@@ -162,34 +297,110 @@ Image Image::resize(int w, int h) const {
   return result;
 }
 
-Image Image::flipHorizontal() const {
-  Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      // set new pixel to old pixel in mirrored half, folded horizontally
-      result.set(i, j, get(_height - 1 - i, j));
+Image Image::resize(int w, int h, const std::vector<Image>& pyramid) const {
+  // levels shrink monotonically, so the last one that still covers the
+  // requested size is the cheapest (and least aliased) place to start
+  const Image* source = this;
+  for (const Image& level : pyramid) {
+    if (level.width() < w || level.height() < h) {
+      break;
+    }
+    source = &level;
+  }
+  return source->resize(w, h);
+}
+
+Image Image::halve(PyramidFilter filter) const {
+  int w = (_width + 1) / 2;
+  int h = (_height + 1) / 2;
+  Image result(w, h);
+  if (filter == BOX_FILTER) {
+    for (int i = 0; i < h; i++) {
+      // odd sizes: the last row/col averages only the pixels that exist
+      int r0 = 2 * i;
+      int r1 = std::min(r0 + 1, _height - 1);
+      const Pixel* top = _pixels + r0 * _width;
+      const Pixel* bottom = _pixels + r1 * _width;
+      for (int j = 0; j < w; j++) {
+        int c0 = 2 * j;
+        int c1 = std::min(c0 + 1, _width - 1);
+        struct Pixel p;
+        p.r = (top[c0].r + top[c1].r + bottom[c0].r + bottom[c1].r + 2) / 4;
+        p.g = (top[c0].g + top[c1].g + bottom[c0].g + bottom[c1].g + 2) / 4;
+        p.b = (top[c0].b + top[c1].b + bottom[c0].b + bottom[c1].b + 2) / 4;
+        result.set(i, j, p);
+      }
+    }
+  } else {
+    // separable binomial [1 3 3 1] / 8 centered between source pixels
+    // 2i and 2i+1, clamping at the borders
+    static const int weights[4] = {1, 3, 3, 1};
+    for (int i = 0; i < h; i++) {
+      for (int j = 0; j < w; j++) {
+        int sum[3] = {0, 0, 0};
+        for (int m = 0; m < 4; m++) {
+          int row = std::min(std::max(2 * i - 1 + m, 0), _height - 1);
+          for (int n = 0; n < 4; n++) {
+            int col = std::min(std::max(2 * j - 1 + n, 0), _width - 1);
+            int weight = weights[m] * weights[n];
+            struct Pixel p = _pixels[row * _width + col];
+            sum[0] += p.r * weight;
+            sum[1] += p.g * weight;
+            sum[2] += p.b * weight;
+          }
+        }
+        struct Pixel p = {(unsigned char) ((sum[0] + 32) / 64),
+            (unsigned char) ((sum[1] + 32) / 64),
+            (unsigned char) ((sum[2] + 32) / 64)};
+        result.set(i, j, p);
+      }
     }
   }
   return result;
 }
 
+std::vector<Image> Image::buildPyramid(int minSize,
+    PyramidFilter filter) const {
+  std::vector<Image> levels;
+  levels.reserve(32);  // sizes are ints, so never more levels than this
+  minSize = std::max(minSize, 1);
+  const Image* previous = this;
+  // each level is produced from the one before it, so the whole chain costs
+  // about a third of a single full-resolution pass
+  while ((previous->width() + 1) / 2 >= minSize &&
+      (previous->height() + 1) / 2 >= minSize &&
+      (previous->width() > 1 || previous->height() > 1)) {
+    levels.push_back(previous->halve(filter));
+    previous = &levels.back();
+  }
+  return levels;
+}
+
+Image Image::flipHorizontal() const {
+  Image result(_width, _height);
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    // copy the row from the mirrored half, folded horizontally
+    PixelSpan<const Pixel> in = row(_height - 1 - i);
+    std::copy(in.begin(), in.end(), out.begin());
+  });
+  return result;
+}
+
 Image Image::flipVertical() const {
   Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      // set new pixel to old pixel in mirrored half, folded vertically
-      result.set(i, j, get(i, _width - 1 - j));
-    }
-  }
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    // copy the row mirrored, folded vertically
+    PixelSpan<const Pixel> in = row(i);
+    std::reverse_copy(in.begin(), in.end(), out.begin());
+  });
   return result;
 }
 
 Image Image::subimage(int startx, int starty, int w, int h) const {
   Image sub(w, h);
   for (int i = 0; i < h; i++) {
-    for (int j = 0; j < w; j++) {
-      sub.set(i, j, get(starty + i, startx + j));
-    }
+    const Pixel* in = row(starty + i).begin() + startx;
+    std::copy(in, in + w, sub.row(i).begin());
   }
   return sub;
 }
@@ -198,25 +409,72 @@ void Image::replace(const Image& image, int startx, int starty) {
   // only replace as many pixels as will fit onto original image
   int rows = std::min(_height - starty, image.height()); // num rows to replace
   int cols = std::min(_width - startx, image.width());  // num cols to replace
-  for (int i = 0; i < rows; i++) {
-    for (int j = 0; j < cols; j++) {
-      set(starty + i, startx + j, image.get(i, j));
+  for (int i = 0; i < rows && cols > 0; i++) {
+    const Pixel* in = image.row(i).begin();
+    std::copy(in, in + cols, row(starty + i).begin() + startx);
+  }
+  markDirty(startx, starty, cols, rows);
+}
+
+void Image::markDirty(int x, int y, int w, int h) {
+  _hashValid = false;
+  // clip to the image
+  int startx = std::max(x, 0);
+  int starty = std::max(y, 0);
+  int endx = std::min(x + w, _width);
+  int endy = std::min(y + h, _height);
+  if (startx >= endx || starty >= endy) {
+    return;
+  }
+  mergeRect(_dirty, Rect{startx, starty, endx - startx, endy - starty});
+}
+
+void mergeRect(std::vector<Rect>& rects, Rect area) {
+  // absorb every rect that overlaps or touches the new one; the grown area
+  // may now reach others, so repeat until nothing changes
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t k = 0; k < rects.size(); k++) {
+      const Rect& other = rects[k];
+      if (other.x <= area.x + area.w && area.x <= other.x + other.w &&
+          other.y <= area.y + area.h && area.y <= other.y + other.h) {
+        int x0 = std::min(area.x, other.x);
+        int y0 = std::min(area.y, other.y);
+        int x1 = std::max(area.x + area.w, other.x + other.w);
+        int y1 = std::max(area.y + area.h, other.y + other.h);
+        area = {x0, y0, x1 - x0, y1 - y0};
+        rects.erase(rects.begin() + k);
+        merged = true;
+        break;
+      }
     }
   }
+  rects.push_back(area);
+}
+
+const std::vector<Rect>& Image::dirtyRegions() const {
+  return _dirty;
+}
+
+void Image::clearDirty() {
+  _dirty.clear();
 }
 
 Image Image::gammaCorrect(float gamma) const {
+  // every channel value maps the same way, so look it up in a table
+  unsigned char corrected[256];
+  for (int v = 0; v < 256; v++) {
+    // RGB values must be converted to float in range [0, 1.0] first
+    corrected[v] = round(pow((v / 255.0f), 1.0f / gamma) * 255.0f);
+  }
   Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel pixel = get(i, j);  // copy original pixel
-      // RGB values must be converted to float in range [0, 1.0] first
-      pixel.r = round(pow((pixel.r / 255.0f), 1.0f / gamma) * 255.0f);
-      pixel.g = round(pow((pixel.g / 255.0f), 1.0f / gamma) * 255.0f);
-      pixel.b = round(pow((pixel.b / 255.0f), 1.0f / gamma) * 255.0f);
-      result.set(i, j, pixel);
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    PixelSpan<const Pixel> in = row(i);
+    for (int j = 0; j < out.size(); j++) {
+      out[j] = {corrected[in[j].r], corrected[in[j].g], corrected[in[j].b]};
     }
-  }
+  });
   return result;
 }
 
@@ -229,26 +487,51 @@ Pixel Image::alphaBlendPixel(const struct Pixel& orig,
   return corrected;
 }
 
-Image Image::alphaBlend(const Image& other, float alpha) const {
-  Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel blend = alphaBlendPixel(get(i, j), other.get(i, j), alpha);
-      result.set(i, j, blend);
+// combine every channel of a and b with op on linear light values in
+// [0, 1]; results are clamped to [0, 1] when encoded back to sRGB
+template <class Op>
+static void blendLinear(const unsigned char* a, const unsigned char* b,
+    unsigned char* out, int width, int height, Op op) {
+  int rowBytes = width * 3;
+  linearToSrgb(0.0f);  // build the lookup tables before the threads start
+  parallelFor(height, [=](int begin, int end) {
+    for (int k = begin * rowBytes; k < end * rowBytes; k++) {
+      out[k] = linearToSrgb(op(srgbToLinear(a[k]), srgbToLinear(b[k])));
     }
+  });
+}
+
+Image Image::alphaBlend(const Image& other, float alpha,
+    bool linearLight) const {
+  Image result(_width, _height);
+  if (!linearLight) {
+    result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+      PixelSpan<const Pixel> p1 = row(i);
+      PixelSpan<const Pixel> p2 = other.row(i);
+      for (int j = 0; j < out.size(); j++) {
+        out[j] = alphaBlendPixel(p1[j], p2[j], alpha);
+      }
+    });
+    return result;
   }
+  blendLinear((const unsigned char*) _pixels,
+      (const unsigned char*) other._pixels, (unsigned char*) result._pixels,
+      _width, _height, [=](float a, float b) {
+    return a * (1 - alpha) + b * alpha;
+  });
   return result;
 }
 
 Image Image::grayscale() const {
   Image result(_width, _height);
   for (int i = 0; i < _height; i++) {
+    const Pixel* row = _pixels + i * _width;
+    Pixel* dst = result._pixels + i * _width;
     for (int j = 0; j < _width; j++) {
-      struct Pixel orig = get(i,j);
-      unsigned char intensity = round((orig.r * 0.3) + (orig.g * 0.59) +
-          (orig.b * 0.11));  // weighted average
-      struct Pixel corrected = {intensity, intensity, intensity};
-      result.set(i, j, corrected);
+      // weighted average (0.3, 0.59, 0.11) in 16.16 fixed point
+      unsigned char intensity = (19661 * row[j].r + 38666 * row[j].g +
+          7209 * row[j].b + 32768) >> 16;
+      dst[j] = {intensity, intensity, intensity};
     }
   }
   return result;
@@ -265,152 +548,269 @@ Image Image::rotate90() const {
   return result;
 }
 
-Image Image::add(const Image& other) const {
+Image Image::warpAffine(const float* matrix, int w, int h,
+    Interpolation interpolation, BorderMode border) const {
+  Image result(w, h);
+  if (_width == 0 || _height == 0) {
+    return result;
+  }
+  const Pixel black = {0, 0, 0};
+  const Pixel* src = _pixels;
+  int srcW = _width;
+  int srcH = _height;
+  // source pixel (row, col), or the border value outside the image
+  auto fetch = [=](int row, int col) {
+    if (row >= 0 && row < srcH && col >= 0 && col < srcW) {
+      return src[row * srcW + col];
+    } else if (border == BORDER_REPLICATE) {
+      row = std::min(std::max(row, 0), srcH - 1);
+      col = std::min(std::max(col, 0), srcW - 1);
+      return src[row * srcW + col];
+    }
+    return black;
+  };
+  // the output is produced in square tiles, whose source footprint is a
+  // small parallelogram that stays in cache for any rotation
+  const int tile = 64;
+  int tilesX = (w + tile - 1) / tile;
+  int tilesY = (h + tile - 1) / tile;
+  // source coordinates in 16.16 fixed point, stepped along each row
+  const double one = 65536.0;
+  int64_t stepX = (int64_t) llround(matrix[0] * one);
+  int64_t stepY = (int64_t) llround(matrix[3] * one);
+  // for bilinear the samples sit at pixel centers
+  double shift = interpolation == BILINEAR ? 0.0 : 0.5;
+  parallelFor(tilesX * tilesY, [&](int begin, int end) {
+    for (int t = begin; t < end; t++) {
+      int x0 = (t % tilesX) * tile;
+      int y0 = (t / tilesX) * tile;
+      int x1 = std::min(x0 + tile, w);
+      int y1 = std::min(y0 + tile, h);
+      for (int i = y0; i < y1; i++) {
+        int64_t fx = (int64_t) llround((matrix[0] * x0 + matrix[1] * i +
+            matrix[2] + shift) * one);
+        int64_t fy = (int64_t) llround((matrix[3] * x0 + matrix[4] * i +
+            matrix[5] + shift) * one);
+        Pixel* dst = result._pixels + i * w;
+        for (int j = x0; j < x1; j++, fx += stepX, fy += stepY) {
+          int col = (int) (fx >> 16);
+          int row = (int) (fy >> 16);
+          if (interpolation == NEAREST) {
+            dst[j] = fetch(row, col);
+            continue;
+          }
+          // 8-bit fractional weights, so the whole blend is integer math
+          int wx = (int) ((fx >> 8) & 255);
+          int wy = (int) ((fy >> 8) & 255);
+          Pixel p00, p01, p10, p11;
+          if (row >= 0 && row + 1 < srcH && col >= 0 && col + 1 < srcW) {
+            const Pixel* q = src + row * srcW + col;
+            p00 = q[0];
+            p01 = q[1];
+            p10 = q[srcW];
+            p11 = q[srcW + 1];
+          } else {
+            p00 = fetch(row, col);
+            p01 = fetch(row, col + 1);
+            p10 = fetch(row + 1, col);
+            p11 = fetch(row + 1, col + 1);
+          }
+          int w00 = (256 - wx) * (256 - wy);
+          int w01 = wx * (256 - wy);
+          int w10 = (256 - wx) * wy;
+          int w11 = wx * wy;
+          dst[j].r = (p00.r * w00 + p01.r * w01 + p10.r * w10 + p11.r * w11 +
+              32768) >> 16;
+          dst[j].g = (p00.g * w00 + p01.g * w01 + p10.g * w10 + p11.g * w11 +
+              32768) >> 16;
+          dst[j].b = (p00.b * w00 + p01.b * w01 + p10.b * w10 + p11.b * w11 +
+              32768) >> 16;
+        }
+      }
+    }
+  }, 1);
+  return result;
+}
+
+Image Image::rotate(float angle, Interpolation interpolation) const {
+  // inverse rotation about the center: counter-clockwise on screen is
+  // clockwise in (col, row) coordinates because rows grow downwards
+  float radians = angle * 3.14159265358979f / 180.0f;
+  float c = cos(radians);
+  float s = sin(radians);
+  float cx = (_width - 1) * 0.5f;
+  float cy = (_height - 1) * 0.5f;
+  float matrix[6] = {c, -s, cx - c * cx + s * cy,
+      s, c, cy - s * cx - c * cy};
+  return warpAffine(matrix, _width, _height, interpolation);
+}
+
+Image Image::scaleTranslate(float sx, float sy, float tx, float ty,
+    Interpolation interpolation) const {
+  // a zero scale collapses the image and has no inverse to sample with
+  if (sx == 0.0f || sy == 0.0f) {
+    return *this;
+  }
+  float matrix[6] = {1.0f / sx, 0.0f, -tx / sx,
+      0.0f, 1.0f / sy, -ty / sy};
+  return warpAffine(matrix, _width, _height, interpolation);
+}
+
+Image Image::add(const Image& other, bool linearLight) const {
   Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel p1 = get(i,j);
-      struct Pixel p2 = other.get(i,j);
+  if (linearLight) {
+    blendLinear((const unsigned char*) _pixels,
+        (const unsigned char*) other._pixels, (unsigned char*) result._pixels,
+        _width, _height, [](float a, float b) { return a + b; });
+    return result;
+  }
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    PixelSpan<const Pixel> p1 = row(i);
+    PixelSpan<const Pixel> p2 = other.row(i);
+    for (int j = 0; j < out.size(); j++) {
       // add colors component-wise, clamp at 255
-      struct Pixel p3 = {(unsigned char) std::min(p1.r + p2.r, 255),
-          (unsigned char) std::min(p1.g + p2.g, 255),
-          (unsigned char) std::min(p1.b + p2.b, 255)};
-      result.set(i, j, p3);
+      out[j] = {(unsigned char) std::min(p1[j].r + p2[j].r, 255),
+          (unsigned char) std::min(p1[j].g + p2[j].g, 255),
+          (unsigned char) std::min(p1[j].b + p2[j].b, 255)};
     }
-  }
+  });
   return result;
 }
 
-Image Image::subtract(const Image& other) const {
+Image Image::subtract(const Image& other, bool linearLight) const {
   Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel p1 = get(i,j);
-      struct Pixel p2 = other.get(i,j);
+  if (linearLight) {
+    blendLinear((const unsigned char*) _pixels,
+        (const unsigned char*) other._pixels, (unsigned char*) result._pixels,
+        _width, _height, [](float a, float b) { return a - b; });
+    return result;
+  }
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    PixelSpan<const Pixel> p1 = row(i);
+    PixelSpan<const Pixel> p2 = other.row(i);
+    for (int j = 0; j < out.size(); j++) {
       // subtract colors component-wise, clamp at 0
-      struct Pixel p3 = {(unsigned char) std::max(p1.r - p2.r, 0),
-          (unsigned char) std::max(p1.g - p2.g, 0),
-          (unsigned char) std::max(p1.b - p2.b, 0)};
-      result.set(i, j, p3);
+      out[j] = {(unsigned char) std::max(p1[j].r - p2[j].r, 0),
+          (unsigned char) std::max(p1[j].g - p2[j].g, 0),
+          (unsigned char) std::max(p1[j].b - p2[j].b, 0)};
     }
-  }
+  });
   return result;
 }
 
-Image Image::multiply(const Image& other) const {
+Image Image::multiply(const Image& other, bool linearLight) const {
   Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel p1 = get(i,j);
-      struct Pixel p2 = other.get(i,j);
+  if (linearLight) {
+    blendLinear((const unsigned char*) _pixels,
+        (const unsigned char*) other._pixels, (unsigned char*) result._pixels,
+        _width, _height, [](float a, float b) { return a * b; });
+    return result;
+  }
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    PixelSpan<const Pixel> p1 = row(i);
+    PixelSpan<const Pixel> p2 = other.row(i);
+    for (int j = 0; j < out.size(); j++) {
       // multiply colors component-wise, clamp at 255
-      struct Pixel p3 = {(unsigned char) std::min(p1.r * p2.r, 255),
-          (unsigned char) std::min(p1.g * p2.g, 255),
-          (unsigned char) std::min(p1.b * p2.b, 255)};
-      result.set(i, j, p3);
+      out[j] = {(unsigned char) std::min(p1[j].r * p2[j].r, 255),
+          (unsigned char) std::min(p1[j].g * p2[j].g, 255),
+          (unsigned char) std::min(p1[j].b * p2[j].b, 255)};
     }
-  }
+  });
   return result;
 }
 
-Image Image::difference(const Image& other) const {
+Image Image::difference(const Image& other, bool linearLight) const {
   Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel p1 = get(i,j);
-      struct Pixel p2 = other.get(i,j);
+  if (linearLight) {
+    blendLinear((const unsigned char*) _pixels,
+        (const unsigned char*) other._pixels, (unsigned char*) result._pixels,
+        _width, _height, [](float a, float b) { return std::abs(a - b); });
+    return result;
+  }
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    PixelSpan<const Pixel> p1 = row(i);
+    PixelSpan<const Pixel> p2 = other.row(i);
+    for (int j = 0; j < out.size(); j++) {
       // subtract colors component-wise, use absolute value
-      struct Pixel p3 = {(unsigned char) std::abs(p1.r - p2.r),
-          (unsigned char) std::abs(p1.g - p2.g),
-          (unsigned char) std::abs(p1.b - p2.b)};
-      result.set(i, j, p3);
+      out[j] = {(unsigned char) std::abs(p1[j].r - p2[j].r),
+          (unsigned char) std::abs(p1[j].g - p2[j].g),
+          (unsigned char) std::abs(p1[j].b - p2[j].b)};
     }
-  }
+  });
   return result;
 }
 
 Image Image::swirl() const {
   Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel orig = get(i,j);
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    PixelSpan<const Pixel> in = row(i);
+    for (int j = 0; j < out.size(); j++) {
       // rotate channels
-      struct Pixel corrected = {orig.g, orig.b, orig.r};
-      result.set(i, j, corrected);
+      out[j] = {in[j].g, in[j].b, in[j].r};
     }
-  }
+  });
   return result;
 }
 
 Image Image::lightest(const Image& other) const {
   Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel p1 = get(i,j);
-      struct Pixel p2 = other.get(i,j);
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    PixelSpan<const Pixel> p1 = row(i);
+    PixelSpan<const Pixel> p2 = other.row(i);
+    for (int j = 0; j < out.size(); j++) {
       // get lightest color
-      struct Pixel p3 = {(unsigned char) std::max(p1.r, p2.r),
-          (unsigned char) std::max(p1.g, p2.g),
-          (unsigned char) std::max(p1.b, p2.b)};
-      result.set(i, j, p3);
+      out[j] = {std::max(p1[j].r, p2[j].r), std::max(p1[j].g, p2[j].g),
+          std::max(p1[j].b, p2[j].b)};
     }
-  }
+  });
   return result;
 }
 
 Image Image::darkest(const Image& other) const {
   Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel p1 = get(i,j);
-      struct Pixel p2 = other.get(i,j);
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    PixelSpan<const Pixel> p1 = row(i);
+    PixelSpan<const Pixel> p2 = other.row(i);
+    for (int j = 0; j < out.size(); j++) {
       // get darkest color
-      struct Pixel p3 = {(unsigned char) std::min(p1.r, p2.r),
-          (unsigned char) std::min(p1.g, p2.g),
-          (unsigned char) std::min(p1.b, p2.b)};
-      result.set(i, j, p3);
+      out[j] = {std::min(p1[j].r, p2[j].r), std::min(p1[j].g, p2[j].g),
+          std::min(p1[j].b, p2[j].b)};
     }
-  }
+  });
   return result;
 }
 
 Image Image::invert() const {
   Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel p = get(i,j);
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    PixelSpan<const Pixel> in = row(i);
+    for (int j = 0; j < out.size(); j++) {
       // subtract colors from 255
-      p.r = 255 - p.r;
-      p.g = 255 - p.g;
-      p.b = 255 - p.b;
-      result.set(i, j, p);
+      out[j] = {(unsigned char) (255 - in[j].r),
+          (unsigned char) (255 - in[j].g), (unsigned char) (255 - in[j].b)};
     }
-  }
+  });
   return result;
 }
 
 Image Image::extractChannel(int channel) const {
+  // only keep the specified channel, others set to zero
+  bool valid = channel >= 1 && channel <= 3;
+  if (!valid) {
+    // no change if invalid channel
+    std::cout << "Invalid channel: " << channel << std::endl;
+  }
+  unsigned char keepR = (!valid || channel == 1) ? 255 : 0;
+  unsigned char keepG = (!valid || channel == 2) ? 255 : 0;
+  unsigned char keepB = (!valid || channel == 3) ? 255 : 0;
   Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel p = get(i,j);
-      // only keep the specified channel, others set to zero
-      if (channel == 1) {
-        p.g = 0;
-        p.b = 0;
-      } else if (channel == 2) {
-        p.r = 0;
-        p.b = 0;
-      } else if (channel == 3) {
-        p.r = 0;
-        p.g = 0;
-      } else {
-        // no change if invalid channel
-        std::cout << "Invalid channel: " << channel << std::endl;
-      }
-      result.set(i, j, p);
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    PixelSpan<const Pixel> in = row(i);
+    for (int j = 0; j < out.size(); j++) {
+      out[j] = {(unsigned char) (in[j].r & keepR),
+          (unsigned char) (in[j].g & keepG), (unsigned char) (in[j].b & keepB)};
     }
-  }
+  });
   return result;
 }
 
@@ -489,16 +889,32 @@ int* Image::convolve(const int * matrix, int * result, int i, int j,
 
 Image Image::blur() const {
   Image result(_width, _height);
+  // interior pixels: the compile time box kernel (see kernels.h)
+  const unsigned char* in = (const unsigned char*) _pixels;
+  unsigned char* out = (unsigned char*) result._pixels;
+  int rowBytes = _width * 3;
+  parallelFor(std::max(_height - 2, 0), [=](int begin, int end) {
+    int bytes = rowBytes;  // local, so stores to out can't change it
+    for (int i = begin + 1; i <= end; i++) {
+      const unsigned char* here = in + i * bytes;
+      unsigned char* dst = out + i * bytes;
+      for (int k = 3; k < bytes - 3; k++) {
+        dst[k] = BoxKernel::scale(BoxKernel::sum(here - bytes + k, here + k,
+            here + bytes + k));
+      }
+    }
+  });
+
+  // border pixels average only the neighbours inside the image
   int matrix[9] = {1, 1, 1, 1, 1, 1, 1, 1, 1};
   for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
+    // inner rows only have a first and last column on the border
+    int step = (i == 0 || i == _height - 1) ? 1 : std::max(_width - 1, 1);
+    for (int j = 0; j < _width; j += step) {
       int convolved[3] = {0, 0, 0};  // sum of convolved area, component-wise
       int denom;  // denominator for averaging neighborhood
       struct Pixel p = get(i,j);
-      if ((i > 0 && i < _height - 1) && (j > 0 && j < _width - 1)) {
-        convolve(matrix, convolved, i, j, MIDDLE);
-        denom = 9;  // middle pixels have 8 neighbors + itself
-      } else if ((i == 0 && j == 0) || (i == 0 && j == _width - 1) ||
+      if ((i == 0 && j == 0) || (i == 0 && j == _width - 1) ||
           (i == _height - 1 && j == 0) ||
           (i == _height - 1 && j == _width - 1)) {
         convolve(matrix, convolved, i, j, CORNER);
@@ -516,51 +932,559 @@ Image Image::blur() const {
   return result;
 }
 
-Image Image::extractWhite(int threshold) const {
-  Image result(_width, _height);
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel p = get(i,j);
-      if (p.r >= threshold && p.g >= threshold && p.b >= threshold) {
-        // meets threshold, set to white
-        p = {255, 255, 255};
-      } else {
-        // set to black
-        p = {0, 0, 0};
+// Young & van Vliet (1995) recursive gaussian: a causal and an anti-causal
+// third order filter, both using the same coefficients
+struct RecursiveGaussian {
+  // double throughout: at large sigma b1 + b2 + b3 is within about 1e-6 of
+  // 1, so in float B (and with it the DC gain) loses most of its precision
+  double B, b1, b2, b3;
+
+  explicit RecursiveGaussian(float sigma) {
+    double q = sigma >= 2.5f ? 0.98711 * sigma - 0.96330 :
+        3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+    double q2 = q * q;
+    double q3 = q2 * q;
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+    b1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+    b2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+    b3 = 0.422205 * q3 / b0;
+    B = 1.0 - (b1 + b2 + b3);
+  }
+
+  // filter n interleaved RGB samples in place, replicating the edge values
+  void apply(float* data, int n) const {
+    for (int c = 0; c < 3; c++) {
+      double w1 = data[c], w2 = data[c], w3 = data[c];
+      for (int k = 0; k < n; k++) {
+        double w = B * data[k * 3 + c] + b1 * w1 + b2 * w2 + b3 * w3;
+        data[k * 3 + c] = (float) w;
+        w3 = w2;
+        w2 = w1;
+        w1 = w;
+      }
+      double last = w1;
+      w1 = last, w2 = last, w3 = last;
+      for (int k = n - 1; k >= 0; k--) {
+        double w = B * data[k * 3 + c] + b1 * w1 + b2 * w2 + b3 * w3;
+        data[k * 3 + c] = (float) w;
+        w3 = w2;
+        w2 = w1;
+        w1 = w;
       }
-      result.set(i, j, p);
     }
   }
+};
+
+// copy an h x w image of RGB floats into a w x h one, in square blocks so
+// both the reads and the writes stay within a few cache lines
+static void transposeRGB(const float* src, float* dst, int w, int h) {
+  const int block = 32;
+  int blockRows = (h + block - 1) / block;
+  parallelFor(blockRows, [=](int begin, int end) {
+    for (int bi = begin * block; bi < std::min(end * block, h); bi += block) {
+      for (int bj = 0; bj < w; bj += block) {
+        for (int i = bi; i < std::min(bi + block, h); i++) {
+          for (int j = bj; j < std::min(bj + block, w); j++) {
+            const float* from = src + (i * w + j) * 3;
+            float* to = dst + (j * h + i) * 3;
+            to[0] = from[0];
+            to[1] = from[1];
+            to[2] = from[2];
+          }
+        }
+      }
+    }
+  }, 1);
+}
+
+Image Image::gaussianBlur(float sigma) const {
+  // the recursive coefficients are only valid from sigma = 0.5 up
+  if (sigma < 0.5f || _width == 0 || _height == 0) {
+    return *this;
+  }
+  RecursiveGaussian filter(sigma);
+  int count = _width * _height * 3;
+  std::vector<float> rows(count);
+  std::vector<float> cols(count);
+  const unsigned char* bytes = (const unsigned char*) _pixels;
+  parallelFor(_height, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      float* row = rows.data() + i * _width * 3;
+      for (int k = 0; k < _width * 3; k++) {
+        row[k] = bytes[i * _width * 3 + k];
+      }
+      filter.apply(row, _width);
+    }
+  });
+  // columns become rows after a transpose, so the second pass is also a
+  // sequential sweep through memory
+  transposeRGB(rows.data(), cols.data(), _width, _height);
+  parallelFor(_width, [&](int begin, int end) {
+    for (int j = begin; j < end; j++) {
+      filter.apply(cols.data() + j * _height * 3, _height);
+    }
+  });
+  transposeRGB(cols.data(), rows.data(), _height, _width);
+
+  Image result(_width, _height);
+  unsigned char* out = (unsigned char*) result._pixels;
+  parallelFor(_height, [&](int begin, int end) {
+    for (int k = begin * _width * 3; k < end * _width * 3; k++) {
+      out[k] = (unsigned char) std::min(std::max(rows[k] + 0.5f, 0.0f),
+          255.0f);
+    }
+  });
   return result;
 }
 
-Image Image::glow(int threshold) const {
+// comparators of Batcher's odd-even merge sort for n elements, keeping only
+// the ones that can influence the middle element
+static std::vector<std::pair<int, int>> medianNetwork(int n) {
+  int size = 1;
+  while (size < n) {
+    size *= 2;
+  }
+  // missing elements act as +infinity, so comparators touching them never
+  // swap anything and can be dropped
+  std::vector<std::pair<int, int>> network;
+  for (int p = 1; p < size; p *= 2) {
+    for (int k = p; k >= 1; k /= 2) {
+      for (int j = k % p; j + k < size; j += 2 * k) {
+        for (int i = 0; i < std::min(k, size - j - k); i++) {
+          if ((i + j) / (2 * p) == (i + j + k) / (2 * p) && i + j + k < n) {
+            network.push_back(std::make_pair(i + j, i + j + k));
+          }
+        }
+      }
+    }
+  }
+  std::vector<bool> needed(n, false);
+  needed[n / 2] = true;
+  std::vector<std::pair<int, int>> pruned;
+  for (int c = (int) network.size() - 1; c >= 0; c--) {
+    if (needed[network[c].first] || needed[network[c].second]) {
+      needed[network[c].first] = needed[network[c].second] = true;
+      pruned.push_back(network[c]);
+    }
+  }
+  std::reverse(pruned.begin(), pruned.end());
+  return pruned;
+}
+
+// a[k], b[k] = min, max of the two. Works through fixed 16 byte blocks of
+// local copies so the compiler can use vector min/max without having to
+// prove that a and b never overlap
+static void compareExchange(unsigned char* a, unsigned char* b, int count) {
+  int k = 0;
+  for (; k + 16 <= count; k += 16) {
+    unsigned char x[16], y[16], lo[16], hi[16];
+    memcpy(x, a + k, 16);
+    memcpy(y, b + k, 16);
+    for (int t = 0; t < 16; t++) {
+      lo[t] = x[t] < y[t] ? x[t] : y[t];
+      hi[t] = x[t] < y[t] ? y[t] : x[t];
+    }
+    memcpy(a + k, lo, 16);
+    memcpy(b + k, hi, 16);
+  }
+  for (; k < count; k++) {
+    unsigned char lo = std::min(a[k], b[k]);
+    unsigned char hi = std::max(a[k], b[k]);
+    a[k] = lo;
+    b[k] = hi;
+  }
+}
+
+// small radius median: gather the shifted neighbor rows and run a sorting
+// network over whole rows at once, so every compare-exchange is a min/max
+// over contiguous bytes
+static void medianNetworkFilter(const Pixel* src, Pixel* dst, int w, int h,
+    int radius) {
+  int window = 2 * radius + 1;
+  int n = window * window;
+  std::vector<std::pair<int, int>> network = medianNetwork(n);
+  int rowBytes = w * 3;
+  parallelFor(h, [&](int begin, int end) {
+    std::vector<unsigned char> rows(n * rowBytes);
+    for (int i = begin; i < end; i++) {
+      for (int m = 0; m < window; m++) {
+        int row = std::min(std::max(i + m - radius, 0), h - 1);
+        const Pixel* line = src + row * w;
+        for (int d = 0; d < window; d++) {
+          Pixel* shifted = (Pixel*) (rows.data() + (m * window + d) *
+              rowBytes);
+          for (int j = 0; j < w; j++) {
+            shifted[j] = line[std::min(std::max(j + d - radius, 0), w - 1)];
+          }
+        }
+      }
+      for (const std::pair<int, int>& c : network) {
+        compareExchange(rows.data() + c.first * rowBytes,
+            rows.data() + c.second * rowBytes, rowBytes);
+      }
+      memcpy(dst + i * w, rows.data() + (n / 2) * rowBytes, rowBytes);
+    }
+  });
+}
+
+// Perreault & Hebert (2007) constant time median: each column keeps a
+// histogram of its (2r + 1) rows, the kernel histogram slides along a row by
+// adding one column histogram and removing another. Histograms are split
+// into 16 coarse bins of 16 fine bins; the kernel keeps only the coarse
+// level current and brings a fine segment up to date when the median lands
+// in it.
+static void medianHistogramFilter(const Pixel* src, Pixel* dst, int w, int h,
+    int radius) {
+  const unsigned char* bytes = (const unsigned char*) src;
+  unsigned char* out = (unsigned char*) dst;
+  int window = 2 * radius + 1;
+  int rank = window * window / 2;
+  parallelFor(h, [&](int begin, int end) {
+    // per column and channel: 256 fine and 16 coarse bins
+    std::vector<uint16_t> colFine(w * 3 * 256, 0);
+    std::vector<uint16_t> colCoarse(w * 3 * 16, 0);
+    auto addRow = [&](int row, int delta) {
+      const unsigned char* line = bytes + row * w * 3;
+      for (int k = 0; k < w * 3; k++) {
+        colFine[k * 256 + line[k]] += delta;
+        colCoarse[k * 16 + (line[k] >> 4)] += delta;
+      }
+    };
+    for (int m = begin - radius; m <= begin + radius; m++) {
+      addRow(std::min(std::max(m, 0), h - 1), 1);
+    }
+    for (int i = begin; i < end; i++) {
+      if (i > begin) {
+        addRow(std::max(i - radius - 1, 0), -1);
+        addRow(std::min(i + radius, h - 1), 1);
+      }
+      for (int c = 0; c < 3; c++) {
+        int coarse[16] = {0};
+        int fine[256] = {0};
+        int updated[16];  // column each fine segment is current for
+        for (int d = -radius; d <= radius; d++) {
+          int col = (std::min(std::max(d, 0), w - 1) * 3 + c);
+          for (int b = 0; b < 16; b++) {
+            coarse[b] += colCoarse[col * 16 + b];
+          }
+          for (int b = 0; b < 256; b++) {
+            fine[b] += colFine[col * 256 + b];
+          }
+        }
+        std::fill(updated, updated + 16, 0);
+        for (int j = 0; j < w; j++) {
+          if (j > 0) {
+            const uint16_t* entering = colCoarse.data() +
+                (std::min(j + radius, w - 1) * 3 + c) * 16;
+            const uint16_t* leaving = colCoarse.data() +
+                (std::max(j - radius - 1, 0) * 3 + c) * 16;
+            for (int b = 0; b < 16; b++) {
+              coarse[b] += entering[b] - leaving[b];
+            }
+          }
+          int seen = 0;
+          int k = 0;
+          while (seen + coarse[k] <= rank) {
+            seen += coarse[k++];
+          }
+          int* segment = fine + k * 16;
+          if (j - updated[k] > window) {
+            // too far behind: cheaper to rebuild from the window directly
+            std::fill(segment, segment + 16, 0);
+            for (int d = j - radius; d <= j + radius; d++) {
+              const uint16_t* column = colFine.data() +
+                  (std::min(std::max(d, 0), w - 1) * 3 + c) * 256 + k * 16;
+              for (int b = 0; b < 16; b++) {
+                segment[b] += column[b];
+              }
+            }
+          } else {
+            for (int t = updated[k] + 1; t <= j; t++) {
+              const uint16_t* entering = colFine.data() +
+                  (std::min(t + radius, w - 1) * 3 + c) * 256 + k * 16;
+              const uint16_t* leaving = colFine.data() +
+                  (std::max(t - radius - 1, 0) * 3 + c) * 256 + k * 16;
+              for (int b = 0; b < 16; b++) {
+                segment[b] += entering[b] - leaving[b];
+              }
+            }
+          }
+          updated[k] = j;
+          int b = 0;
+          while (seen + segment[b] <= rank) {
+            seen += segment[b++];
+          }
+          out[(i * w + j) * 3 + c] = (unsigned char) (k * 16 + b);
+        }
+      }
+    }
+  });
+}
+
+Image Image::median(int radius) const {
   Image result(_width, _height);
-  Image whitened = extractWhite(threshold);
-  whitened = whitened.blur();
-  for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
-      struct Pixel whiteP = whitened.get(i, j);
-      float alpha = (whiteP.r + whiteP.g + whiteP.b) / (6 * 255.0f);
-      result.set(i, j, alphaBlendPixel(get(i, j), whiteP, alpha));
+  // the work per row grows with the radius; past the image size the
+  // window is almost all replicated edge anyway
+  radius = std::min(radius, std::max(_width, _height));
+  if (radius <= 0) {
+    return *this;
+  } else if (radius <= 2) {
+    medianNetworkFilter(_pixels, result._pixels, _width, _height, radius);
+  } else {
+    medianHistogramFilter(_pixels, result._pixels, _width, _height, radius);
+  }
+  return result;
+}
+
+struct MaxOp {
+  static unsigned char identity() { return 0; }
+  unsigned char operator()(unsigned char a, unsigned char b) const {
+    return a > b ? a : b;
+  }
+};
+
+struct MinOp {
+  static unsigned char identity() { return 255; }
+  unsigned char operator()(unsigned char a, unsigned char b) const {
+    return a < b ? a : b;
+  }
+};
+
+// van Herk/Gil-Werman running max/min over a window of 2 * radius + 1
+// elements, each element being `width` interleaved bytes. The (padded)
+// input is cut into window-sized blocks; forward holds the running result
+// from the start of each block, backward from its end, and any window
+// covers exactly the tail of one block and the head of the next, so every
+// output is one more op regardless of the radius. Outside the input counts
+// as the op's identity, i.e. windows are clipped at the border.
+template <class Op>
+static void runningExtreme(const unsigned char* src, unsigned char* dst,
+    int count, int width, int srcStride, int dstStride, int radius,
+    std::vector<unsigned char>& forward, std::vector<unsigned char>& backward) {
+  Op op;
+  // windows are clipped, so a radius past the input changes nothing (and
+  // must not overflow the window size)
+  radius = std::min(radius, count);
+  int window = 2 * radius + 1;
+  int padded = count + 2 * radius;
+  forward.resize(padded * width);
+  backward.resize(padded * width);
+  for (int i = 0; i < padded; i++) {
+    int k = i - radius;
+    unsigned char* f = forward.data() + i * width;
+    if (k >= 0 && k < count) {
+      std::copy(src + k * srcStride, src + k * srcStride + width, f);
+    } else {
+      std::fill(f, f + width, Op::identity());
+    }
+    if (i % window != 0) {
+      const unsigned char* previous = f - width;
+      for (int b = 0; b < width; b++) {
+        f[b] = op(f[b], previous[b]);
+      }
+    }
+  }
+  for (int i = padded - 1; i >= 0; i--) {
+    int k = i - radius;
+    unsigned char* g = backward.data() + i * width;
+    if (k >= 0 && k < count) {
+      std::copy(src + k * srcStride, src + k * srcStride + width, g);
+    } else {
+      std::fill(g, g + width, Op::identity());
+    }
+    if (i % window != window - 1 && i != padded - 1) {
+      const unsigned char* next = g + width;
+      for (int b = 0; b < width; b++) {
+        g[b] = op(g[b], next[b]);
+      }
+    }
+  }
+  for (int k = 0; k < count; k++) {
+    // window [k - radius, k + radius] is padded [k, k + window - 1]
+    const unsigned char* g = backward.data() + k * width;
+    const unsigned char* f = forward.data() + (k + window - 1) * width;
+    unsigned char* out = dst + k * dstStride;
+    for (int b = 0; b < width; b++) {
+      out[b] = op(g[b], f[b]);
     }
   }
+}
+
+// separable rectangular max/min filter over an image of interleaved 8-bit
+// channels (works for RGB as well as single channel masks)
+template <class Op>
+static void morphology(const unsigned char* src, unsigned char* dst,
+    int w, int h, int channels, int rx, int ry) {
+  int rowBytes = w * channels;
+  std::vector<unsigned char> horizontal(rowBytes * h);
+  // horizontal pass: elements are pixels, one row at a time
+  parallelFor(h, [&](int begin, int end) {
+    std::vector<unsigned char> forward, backward;
+    for (int i = begin; i < end; i++) {
+      runningExtreme<Op>(src + i * rowBytes, horizontal.data() + i * rowBytes,
+          w, channels, channels, channels, rx, forward, backward);
+    }
+  });
+  // vertical pass: elements are strips of whole rows, so the inner loops
+  // run over contiguous bytes and vectorize
+  const int strip = 256;
+  int strips = (rowBytes + strip - 1) / strip;
+  parallelFor(strips, [&](int begin, int end) {
+    std::vector<unsigned char> forward, backward;
+    for (int s = begin; s < end; s++) {
+      int offset = s * strip;
+      runningExtreme<Op>(horizontal.data() + offset, dst + offset, h,
+          std::min(strip, rowBytes - offset), rowBytes, rowBytes, ry,
+          forward, backward);
+    }
+  }, 1);
+}
+
+Image Image::dilate(int radius, int radiusY) const {
+  Image result(_width, _height);
+  morphology<MaxOp>((const unsigned char*) _pixels,
+      (unsigned char*) result._pixels, _width, _height, 3,
+      std::max(radius, 0), radiusY < 0 ? std::max(radius, 0) : radiusY);
+  return result;
+}
+
+Image Image::erode(int radius, int radiusY) const {
+  Image result(_width, _height);
+  morphology<MinOp>((const unsigned char*) _pixels,
+      (unsigned char*) result._pixels, _width, _height, 3,
+      std::max(radius, 0), radiusY < 0 ? std::max(radius, 0) : radiusY);
   return result;
 }
 
+Image Image::open(int radius, int radiusY) const {
+  return erode(radius, radiusY).dilate(radius, radiusY);
+}
+
+Image Image::close(int radius, int radiusY) const {
+  return dilate(radius, radiusY).erode(radius, radiusY);
+}
+
+Image Image::extractWhite(int threshold) const {
+  Image result(_width, _height);
+  result.forEachRow([&](int i, PixelSpan<Pixel> out) {
+    PixelSpan<const Pixel> in = row(i);
+    for (int j = 0; j < out.size(); j++) {
+      // white if all channels meet the threshold, black otherwise
+      unsigned char value = (in[j].r >= threshold && in[j].g >= threshold &&
+          in[j].b >= threshold) ? 255 : 0;
+      out[j] = {value, value, value};
+    }
+  });
+  return result;
+}
+
+Image Image::glow(int threshold, int radius) const {
+  Image result(_width, _height);
+  // windows are clipped at the border, so larger radii change nothing
+  radius = std::min(std::max(radius, 0), std::max(_width, _height));
+  // same threshold as extractWhite, but one byte per pixel
+  std::vector<unsigned char> mask(_width * _height);
+  parallelFor(_height, [&](int begin, int end) {
+    for (int k = begin * _width; k < end * _width; k++) {
+      struct Pixel p = _pixels[k];
+      mask[k] = (p.r >= threshold && p.g >= threshold && p.b >= threshold) ?
+          255 : 0;
+    }
+  });
+  // Each band of rows keeps running column sums of the mask over the rows
+  // in [i - radius, i + radius]; a running sum across those gives the box
+  // sum for every pixel in O(1), which is then blended in the same sweep
+  parallelFor(_height, [&](int begin, int end) {
+    std::vector<int> columns(_width, 0);
+    for (int m = std::max(begin - radius, 0);
+        m <= std::min(begin + radius, _height - 1); m++) {
+      for (int j = 0; j < _width; j++) {
+        columns[j] += mask[m * _width + j];
+      }
+    }
+    for (int i = begin; i < end; i++) {
+      // windows are clipped at the border, as in blur()
+      int rows = std::min(i + radius, _height - 1) - std::max(i - radius, 0)
+          + 1;
+      int sum = 0;
+      for (int j = 0; j <= std::min(radius, _width - 1); j++) {
+        sum += columns[j];
+      }
+      for (int j = 0; j < _width; j++) {
+        int cols = std::min(j + radius, _width - 1) - std::max(j - radius, 0)
+            + 1;
+        int count = rows * cols;
+        int white = (sum + count / 2) / count;  // blurred mask value
+        // blend towards white with alpha = white / 510 (half strength)
+        struct Pixel p = _pixels[i * _width + j];
+        p.r = (white * white + p.r * (510 - white) + 255) / 510;
+        p.g = (white * white + p.g * (510 - white) + 255) / 510;
+        p.b = (white * white + p.b * (510 - white) + 255) / 510;
+        result._pixels[i * _width + j] = p;
+        if (j + radius + 1 < _width) {
+          sum += columns[j + radius + 1];
+        }
+        if (j - radius >= 0) {
+          sum -= columns[j - radius];
+        }
+      }
+      if (i + radius + 1 < _height) {
+        const unsigned char* entering = mask.data() + (i + radius + 1) * _width;
+        for (int j = 0; j < _width; j++) {
+          columns[j] += entering[j];
+        }
+      }
+      if (i - radius >= 0) {
+        const unsigned char* leaving = mask.data() + (i - radius) * _width;
+        for (int j = 0; j < _width; j++) {
+          columns[j] -= leaving[j];
+        }
+      }
+    }
+  });
+  return result;
+}
+
+// gradient kernels of sobelEdge; the bottom row of gx differs from the
+// textbook Sobel kernel (SobelXKernel), kept so output stays the same
+typedef Kernel3x3<1, 0, -1, 2, 0, -2, 0, 0, -1> SobelEdgeX;
+typedef Kernel3x3<1, 2, 1, 0, 0, 0, -1, -2, -1> SobelEdgeY;
+
 Image Image::sobelEdge() const {
   Image result(_width, _height);
+  // interior pixels: compile time kernels (see kernels.h)
+  const unsigned char* in = (const unsigned char*) _pixels;
+  unsigned char* out = (unsigned char*) result._pixels;
+  int rowBytes = _width * 3;
+  parallelFor(std::max(_height - 2, 0), [=](int begin, int end) {
+    int bytes = rowBytes;  // local, so stores to out can't change it
+    for (int i = begin + 1; i <= end; i++) {
+      const unsigned char* here = in + i * bytes;
+      unsigned char* dst = out + i * bytes;
+      for (int k = 3; k < bytes - 3; k++) {
+        int gx = SobelEdgeX::sum(here - bytes + k, here + k, here + bytes + k);
+        int gy = SobelEdgeY::sum(here - bytes + k, here + k, here + bytes + k);
+        // clamp before the square root (255.5^2 > 65280), which keeps the
+        // loop free of branches; single precision is exact enough, as no
+        // square root of an integer below 65281 is within float error of x.5
+        int squared = std::min(gx * gx + gy * gy, 65280);
+        dst[k] = (unsigned char) (int) (sqrtf((float) squared) + 0.5f);
+      }
+    }
+  });
+
+  // border pixels only use the neighbours inside the image
   int gx[9] = {1, 0, -1, 2, 0, -2, 0, 0, -1};
   int gy[9] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
   for (int i = 0; i < _height; i++) {
-    for (int j = 0; j < _width; j++) {
+    // inner rows only have a first and last column on the border
+    int step = (i == 0 || i == _height - 1) ? 1 : std::max(_width - 1, 1);
+    for (int j = 0; j < _width; j += step) {
       int gxConv[3] = {0, 0, 0};  // sum of convolved area, component-wise
       int gyConv[3] = {0, 0, 0};  // sum of convolved area, component-wise
       struct Pixel p = get(i, j);
       Position position;
-      if ((i > 0 && i < _height - 1) && (j > 0 && j < _width - 1)) {
-        position = MIDDLE;
-      } else if ((i == 0 && j == 0) || (i == 0 && j == _width - 1) ||
+      if ((i == 0 && j == 0) || (i == 0 && j == _width - 1) ||
           (i == _height - 1 && j == 0) ||
           (i == _height - 1 && j == _width - 1)) {
         position = CORNER;
@@ -613,4 +1537,489 @@ Image Image::bitMap() const {
 }
 
 
+Image stackReduce(const std::vector<const Image*>& images, ReduceMode mode,
+    const std::vector<float>& weights) {
+  if (images.empty()) {
+    return Image();
+  }
+  int n = (int) images.size();
+  int w = images[0]->width();
+  int h = images[0]->height();
+  Image result(w, h);
+  int rowBytes = w * 3;
+  unsigned char* out = (unsigned char*) result.data();
+
+  // weights become 16.16 fixed point fractions of their total, so the
+  // weighted sum of 8-bit values always fits in 32 bits
+  std::vector<uint32_t> fixedWeights(n, 0);
+  if (mode == REDUCE_WEIGHTED_MEAN) {
+    double total = 0;
+    for (int k = 0; k < n && k < (int) weights.size(); k++) {
+      total += std::max(weights[k], 0.0f);
+    }
+    for (int k = 0; k < n; k++) {
+      float weight = k < (int) weights.size() ? std::max(weights[k], 0.0f) :
+          0.0f;
+      fixedWeights[k] = total > 0 ? (uint32_t) (weight / total * 65536 + 0.5) :
+          (65536 + n / 2) / n;
+    }
+  }
+
+  // each row is handled in tiles small enough that the accumulators and
+  // the tile of every input stay in cache while the stack is walked
+  const int tile = 1024;
+  parallelFor(h, [&](int begin, int end) {
+    std::vector<uint32_t> sums(tile);
+    std::vector<unsigned char> values(mode == REDUCE_MEDIAN ? tile * n : 0);
+    for (int i = begin; i < end; i++) {
+      for (int start = 0; start < rowBytes; start += tile) {
+        int count = std::min(tile, rowBytes - start);
+        unsigned char* dst = out + i * rowBytes + start;
+        if (mode == REDUCE_MAX || mode == REDUCE_MIN) {
+          const unsigned char* first = (const unsigned char*) images[0]->data()
+              + i * rowBytes + start;
+          memcpy(dst, first, count);
+          for (int k = 1; k < n; k++) {
+            const unsigned char* src = (const unsigned char*)
+                images[k]->data() + i * rowBytes + start;
+            if (mode == REDUCE_MAX) {
+              for (int b = 0; b < count; b++) {
+                dst[b] = dst[b] < src[b] ? src[b] : dst[b];
+              }
+            } else {
+              for (int b = 0; b < count; b++) {
+                dst[b] = dst[b] < src[b] ? dst[b] : src[b];
+              }
+            }
+          }
+        } else if (mode == REDUCE_MEDIAN) {
+          for (int k = 0; k < n; k++) {
+            const unsigned char* src = (const unsigned char*)
+                images[k]->data() + i * rowBytes + start;
+            for (int b = 0; b < count; b++) {
+              values[b * n + k] = src[b];
+            }
+          }
+          for (int b = 0; b < count; b++) {
+            unsigned char* stack = values.data() + b * n;
+            std::nth_element(stack, stack + n / 2, stack + n);
+            int middle = stack[n / 2];
+            if (n % 2 == 0) {
+              // even stacks average the two middle values
+              int below = *std::max_element(stack, stack + n / 2);
+              middle = (middle + below + 1) / 2;
+            }
+            dst[b] = (unsigned char) middle;
+          }
+        } else {
+          std::fill(sums.begin(), sums.begin() + count, 0);
+          for (int k = 0; k < n; k++) {
+            const unsigned char* src = (const unsigned char*)
+                images[k]->data() + i * rowBytes + start;
+            uint32_t weight = mode == REDUCE_WEIGHTED_MEAN ? fixedWeights[k] :
+                1;
+            for (int b = 0; b < count; b++) {
+              sums[b] += src[b] * weight;
+            }
+          }
+          for (int b = 0; b < count; b++) {
+            uint32_t value;
+            if (mode == REDUCE_MEAN) {
+              value = (sums[b] + n / 2) / n;
+            } else if (mode == REDUCE_WEIGHTED_MEAN) {
+              value = (sums[b] + 32768) >> 16;
+            } else {
+              value = sums[b];
+            }
+            dst[b] = (unsigned char) std::min(value, 255u);
+          }
+        }
+      }
+    }
+  });
+  return result;
+}
+
+// colors are binned to 5 bits per channel for the histogram and the
+// inverse color lookup
+static inline int colorBin(int r, int g, int b) {
+  return ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+}
+
+// a median cut box: a range of histogram bins, sorted along some axis
+struct ColorBox {
+  int begin;
+  int end;
+  int axis;  // channel with the widest range
+  int range;
+  uint64_t count;
+};
+
+Image Image::quantize(int colors, Dither dither) const {
+  colors = std::min(std::max(colors, 2), 256);
+  Image result(_width, _height);
+  int total = _width * _height;
+  if (total == 0) {
+    return result;
+  }
+  // sampled histogram with per-bin color sums; each thread fills its own
+  // copy, merged afterwards
+  const int bins = 1 << 15;
+  int step = std::max(1, total / (1 << 20));
+  int samples = (total + step - 1) / step;
+  std::vector<uint64_t> counts(bins, 0);
+  std::vector<uint64_t> sums(bins * 3, 0);
+  std::mutex merge;
+  parallelFor(samples, [&](int begin, int end) {
+    std::vector<uint32_t> localCounts(bins, 0);
+    std::vector<uint64_t> localSums(bins * 3, 0);
+    for (int k = begin; k < end; k++) {
+      const Pixel& p = _pixels[(int64_t) k * step];
+      int bin = colorBin(p.r, p.g, p.b);
+      localCounts[bin]++;
+      localSums[bin * 3] += p.r;
+      localSums[bin * 3 + 1] += p.g;
+      localSums[bin * 3 + 2] += p.b;
+    }
+    std::lock_guard<std::mutex> lock(merge);
+    for (int bin = 0; bin < bins; bin++) {
+      counts[bin] += localCounts[bin];
+      sums[bin * 3] += localSums[bin * 3];
+      sums[bin * 3 + 1] += localSums[bin * 3 + 1];
+      sums[bin * 3 + 2] += localSums[bin * 3 + 2];
+    }
+  }, 4096);
+
+  // median cut over the occupied bins
+  std::vector<int> occupied;
+  for (int bin = 0; bin < bins; bin++) {
+    if (counts[bin] > 0) {
+      occupied.push_back(bin);
+    }
+  }
+  auto channel = [](int bin, int axis) {
+    return (bin >> (10 - 5 * axis)) & 31;
+  };
+  auto measure = [&](ColorBox& box) {
+    int low[3] = {31, 31, 31};
+    int high[3] = {0, 0, 0};
+    box.count = 0;
+    for (int k = box.begin; k < box.end; k++) {
+      for (int axis = 0; axis < 3; axis++) {
+        low[axis] = std::min(low[axis], channel(occupied[k], axis));
+        high[axis] = std::max(high[axis], channel(occupied[k], axis));
+      }
+      box.count += counts[occupied[k]];
+    }
+    box.axis = 0;
+    for (int axis = 1; axis < 3; axis++) {
+      if (high[axis] - low[axis] > high[box.axis] - low[box.axis]) {
+        box.axis = axis;
+      }
+    }
+    box.range = high[box.axis] - low[box.axis];
+  };
+  std::vector<ColorBox> boxes(1);
+  boxes[0].begin = 0;
+  boxes[0].end = (int) occupied.size();
+  measure(boxes[0]);
+  while ((int) boxes.size() < colors) {
+    // split the box with the most pixels times spread
+    int best = -1;
+    double bestScore = 0;
+    for (int k = 0; k < (int) boxes.size(); k++) {
+      double score = (double) boxes[k].count * boxes[k].range;
+      if (boxes[k].end - boxes[k].begin > 1 && score > bestScore) {
+        best = k;
+        bestScore = score;
+      }
+    }
+    if (best < 0) {
+      break;  // fewer distinct bins than colors
+    }
+    ColorBox& box = boxes[best];
+    int axis = box.axis;
+    std::sort(occupied.begin() + box.begin, occupied.begin() + box.end,
+        [&](int a, int b) { return channel(a, axis) < channel(b, axis); });
+    // cut at the pixel-weighted median, keeping both halves non-empty
+    uint64_t half = box.count / 2;
+    uint64_t seen = 0;
+    int cut = box.begin + 1;
+    for (int k = box.begin; k < box.end - 1; k++) {
+      seen += counts[occupied[k]];
+      cut = k + 1;
+      if (seen >= half) {
+        break;
+      }
+    }
+    ColorBox upper = box;
+    upper.begin = cut;
+    box.end = cut;
+    measure(box);
+    measure(upper);
+    boxes.push_back(upper);
+  }
+  std::vector<Pixel> palette;
+  for (const ColorBox& box : boxes) {
+    uint64_t sum[3] = {0, 0, 0};
+    for (int k = box.begin; k < box.end; k++) {
+      for (int c = 0; c < 3; c++) {
+        sum[c] += sums[occupied[k] * 3 + c];
+      }
+    }
+    palette.push_back(Pixel{(unsigned char) ((sum[0] + box.count / 2) /
+        box.count), (unsigned char) ((sum[1] + box.count / 2) / box.count),
+        (unsigned char) ((sum[2] + box.count / 2) / box.count)});
+  }
+
+  // Inverse color lookup: for a bin, the palette entries that can be
+  // nearest to some color inside it. An entry is skipped when even its
+  // closest point of the bin is farther than the farthest point of the
+  // bin is from some other entry. Pixels are then matched exactly against
+  // a handful of candidates instead of the whole palette
+  std::vector<std::vector<unsigned char>> candidates(bins);
+  std::vector<unsigned char> built(bins, 0);
+  auto build = [&](int bin) {
+    int low[3] = {channel(bin, 0) << 3, channel(bin, 1) << 3,
+        channel(bin, 2) << 3};
+    // squared distance from entry k to the nearest (or farthest) color
+    // of the bin
+    auto distance = [&](int k, bool farthest) {
+      int value[3] = {palette[k].r, palette[k].g, palette[k].b};
+      int sum = 0;
+      for (int c = 0; c < 3; c++) {
+        int below = low[c] - value[c];
+        int above = value[c] - (low[c] + 7);
+        int d = farthest ? std::max(std::abs(below), std::abs(above)) :
+            std::max(std::max(below, above), 0);
+        sum += d * d;
+      }
+      return sum;
+    };
+    int bound = 1 << 30;
+    for (int k = 0; k < (int) palette.size(); k++) {
+      bound = std::min(bound, distance(k, true));
+    }
+    for (int k = 0; k < (int) palette.size(); k++) {
+      if (distance(k, false) <= bound) {
+        candidates[bin].push_back((unsigned char) k);
+      }
+    }
+    built[bin] = 1;
+  };
+  // palette entry nearest to (r, g, b), whose bin must be built; ties go
+  // to the lower index
+  auto nearest = [&](int r, int g, int b) {
+    int best = 0;
+    int bestDistance = 1 << 30;
+    for (unsigned char k : candidates[colorBin(r, g, b)]) {
+      int dr = r - palette[k].r;
+      int dg = g - palette[k].g;
+      int db = b - palette[k].b;
+      int distance = dr * dr + dg * dg + db * db;
+      if (distance < bestDistance) {
+        best = k;
+        bestDistance = distance;
+      }
+    }
+    return (unsigned char) best;
+  };
+
+  // keep the index of every pixel too, so save() can write them directly
+  result._indices.resize(total);
+  if (dither == DITHER_NONE) {
+    // build only the bins that pixels fall in, in parallel, before mapping
+    std::vector<unsigned char> needed(bins, 0);
+    for (int k = 0; k < total; k++) {
+      needed[colorBin(_pixels[k].r, _pixels[k].g, _pixels[k].b)] = 1;
+    }
+    parallelFor(bins, [&](int begin, int end) {
+      for (int bin = begin; bin < end; bin++) {
+        if (needed[bin]) {
+          build(bin);
+        }
+      }
+    }, 1024);
+    parallelFor(_height, [&](int begin, int end) {
+      for (int k = begin * _width; k < end * _width; k++) {
+        const Pixel& p = _pixels[k];
+        unsigned char index = nearest(p.r, p.g, p.b);
+        result._indices[k] = index;
+        result._pixels[k] = palette[index];
+      }
+    });
+  } else {
+    // Floyd-Steinberg: errors (in 1/16ths) carried to the current and next
+    // row, with one pixel of padding on each side
+    std::vector<int> current((_width + 2) * 3, 0);
+    std::vector<int> next((_width + 2) * 3, 0);
+    for (int i = 0; i < _height; i++) {
+      std::fill(next.begin(), next.end(), 0);
+      for (int j = 0; j < _width; j++) {
+        const Pixel& p = _pixels[i * _width + j];
+        int value[3] = {p.r, p.g, p.b};
+        int* error = current.data() + (j + 1) * 3;
+        for (int c = 0; c < 3; c++) {
+          // round the carried error half away from zero; truncating would
+          // pull it towards zero and bias dark and bright areas
+          int carried = error[c] >= 0 ? (error[c] + 8) / 16 :
+              -((8 - error[c]) / 16);
+          value[c] = std::min(std::max(value[c] + carried, 0), 255);
+        }
+        int bin = colorBin(value[0], value[1], value[2]);
+        if (!built[bin]) {
+          build(bin);  // one row after another, so built as needed
+        }
+        unsigned char index = nearest(value[0], value[1], value[2]);
+        const Pixel& chosen = palette[index];
+        result._indices[i * _width + j] = index;
+        result._pixels[i * _width + j] = chosen;
+        int chosenValue[3] = {chosen.r, chosen.g, chosen.b};
+        for (int c = 0; c < 3; c++) {
+          int e = value[c] - chosenValue[c];
+          error[3 + c] += e * 7;
+          next[j * 3 + c] += e * 3;
+          next[(j + 1) * 3 + c] += e * 5;
+          next[(j + 2) * 3 + c] += e;
+        }
+      }
+      std::swap(current, next);
+    }
+  }
+  result._palette = palette;
+  result._indicesHash = result.hash();
+  return result;
+}
+
+const std::vector<Pixel>& Image::palette() const {
+  return _palette;
+}
+
+SummedAreaTable Image::summedAreaTable() const {
+  return SummedAreaTable(*this);
+}
+
+Image Image::pixelate(int blockW, int blockH) const {
+  Image result(*this);
+  result.pixelate(SummedAreaTable(*this), 0, 0, _width, _height,
+      blockW, blockH);
+  return result;
+}
+
+void Image::pixelate(const SummedAreaTable& table, int x, int y, int w,
+    int h, int blockW, int blockH) {
+  if (table.width() != _width || table.height() != _height) {
+    return;  // table of a different image; its sums don't cover this one
+  }
+  blockW = std::max(blockW, 1);
+  blockH = std::max(blockH, 1);
+  int startx = std::max(x, 0);
+  int starty = std::max(y, 0);
+  int endx = std::min(x + w, _width);
+  int endy = std::min(y + h, _height);
+  if (startx >= endx || starty >= endy) {
+    return;
+  }
+  // blocks are aligned to the region, and the last ones may be partial
+  int blockRows = (endy - starty + blockH - 1) / blockH;
+  parallelFor(blockRows, [&](int begin, int end) {
+    for (int by = starty + begin * blockH; by < starty + end * blockH &&
+        by < endy; by += blockH) {
+      int bh = std::min(blockH, endy - by);
+      for (int bx = startx; bx < endx; bx += blockW) {
+        int bw = std::min(blockW, endx - bx);
+        struct Pixel mean = table.regionMean(bx, by, bw, bh);
+        for (int i = by; i < by + bh; i++) {
+          std::fill(_pixels + i * _width + bx, _pixels + i * _width + bx + bw,
+              mean);
+        }
+      }
+    }
+  }, 1);
+  // drops the cached hash too, so cached results of the unredacted image
+  // can't be returned for it
+  markDirty(startx, starty, endx - startx, endy - starty);
+}
+
+SummedAreaTable::SummedAreaTable() {  }
+
+SummedAreaTable::SummedAreaTable(const Image& image):
+    _width(image.width()), _height(image.height()),
+    _sums((image.width() + 1) * (image.height() + 1) * 3, 0) {
+  const unsigned char* bytes = (const unsigned char*) image.data();
+  int stride = (_width + 1) * 3;
+  // prefix sums along each row...
+  parallelFor(_height, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      uint32_t* row = _sums.data() + (i + 1) * stride;
+      const unsigned char* src = bytes + i * _width * 3;
+      for (int k = 0; k < _width * 3; k++) {
+        row[k + 3] = row[k] + src[k];
+      }
+    }
+  });
+  // ...then down each column, vectorized across a slice of every row
+  parallelFor(stride, [&](int begin, int end) {
+    for (int i = 1; i <= _height; i++) {
+      uint32_t* row = _sums.data() + i * stride;
+      const uint32_t* above = row - stride;
+      for (int k = begin; k < end; k++) {
+        row[k] += above[k];  // unsigned, so overflow wraps around
+      }
+    }
+  }, 64);
+}
+
+int SummedAreaTable::width() const {
+  return _width;
+}
+
+int SummedAreaTable::height() const {
+  return _height;
+}
+
+void SummedAreaTable::bandSum(int x, int y, int w, int h,
+    uint64_t* sums) const {
+  int stride = (_width + 1) * 3;
+  const uint32_t* top = _sums.data() + y * stride;
+  const uint32_t* bottom = _sums.data() + (y + h) * stride;
+  for (int c = 0; c < 3; c++) {
+    uint32_t sum = bottom[(x + w) * 3 + c] - bottom[x * 3 + c]
+        - top[(x + w) * 3 + c] + top[x * 3 + c];
+    sums[c] += sum;
+  }
+}
+
+void SummedAreaTable::regionSum(int x, int y, int w, int h,
+    uint64_t* sums) const {
+  sums[0] = sums[1] = sums[2] = 0;
+  int startx = std::max(x, 0);
+  int starty = std::max(y, 0);
+  int endx = std::min(x + w, _width);
+  int endy = std::min(y + h, _height);
+  if (startx >= endx || starty >= endy) {
+    return;
+  }
+  // largest pixel count whose sum of 255s still fits in 32 bits
+  const int64_t safePixels = 0xFFFFFFFFu / 255;
+  int bandRows = (int) std::max<int64_t>(1, safePixels / (endx - startx));
+  for (int i = starty; i < endy; i += bandRows) {
+    bandSum(startx, i, endx - startx, std::min(bandRows, endy - i), sums);
+  }
+}
+
+Pixel SummedAreaTable::regionMean(int x, int y, int w, int h) const {
+  uint64_t sums[3];
+  regionSum(x, y, w, h, sums);
+  int cols = std::max(std::min(x + w, _width) - std::max(x, 0), 0);
+  int rows = std::max(std::min(y + h, _height) - std::max(y, 0), 0);
+  int64_t count = (int64_t) cols * rows;
+  if (count == 0) {
+    return Pixel{0, 0, 0};
+  }
+  return Pixel{(unsigned char) ((sums[0] + count / 2) / count),
+      (unsigned char) ((sums[1] + count / 2) / count),
+      (unsigned char) ((sums[2] + count / 2) / count)};
+}
+
 }  // namespace agl
@@ -8,8 +8,12 @@
 #ifndef AGL_IMAGE_H_
 #define AGL_IMAGE_H_
 
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 namespace agl {
 
@@ -26,6 +30,62 @@ struct Pixel {
 // used in convolutions to specify location of pixel
 enum Position {MIDDLE, CORNER, EDGE};
 
+// filter used when building each 2x-downsampled pyramid level
+enum PyramidFilter {BOX_FILTER, GAUSSIAN_FILTER};
+
+// how warpAffine samples the source image
+enum Interpolation {NEAREST, BILINEAR};
+
+// what warpAffine uses for source positions outside the image
+enum BorderMode {BORDER_CONSTANT, BORDER_REPLICATE};
+
+// error diffusion used by quantize
+enum Dither {DITHER_NONE, DITHER_FLOYD_STEINBERG};
+
+/**
+ * @brief Axis aligned rectangle in pixels, (x, y) is the top left corner
+ */
+struct Rect {
+  int x;
+  int y;
+  int w;
+  int h;
+};
+
+// add area to rects, first absorbing every rect it overlaps or touches, so
+// rects never overlap each other
+void mergeRect(std::vector<Rect>& rects, Rect area);
+
+/**
+ * @brief A contiguous run of pixels, e.g. one row of an Image
+ *
+ * Iterators are plain pointers, so loops over a span compile like loops
+ * over an array. T is Pixel, or const Pixel for read only access.
+ */
+template <class T>
+class PixelSpan {
+ public:
+  PixelSpan(T* data, int size): _data(data), _size(size) {  }
+
+  // a span of pixels can always be read as a span of const pixels
+  template <class U, class = typename std::enable_if<
+      std::is_convertible<U*, T*>::value>::type>
+  PixelSpan(const PixelSpan<U>& other): _data(other.data()),
+      _size(other.size()) {  }
+
+  T* begin() const { return _data; }
+  T* end() const { return _data + _size; }
+  T* data() const { return _data; }
+  int size() const { return _size; }
+  T& operator[](int i) const { return _data[i]; }
+
+ private:
+  T* _data;
+  int _size;
+};
+
+class SummedAreaTable;
+
 /**
  * @brief Implements loading, modifying, and saving RGB images
  */
@@ -51,9 +111,22 @@ class Image {
    * @brief Save the image to the given filename (.png)
    * @param filename The file to load, relative to the running directory
    * @param flip Whether the file should flipped vertically before being saved
+   *
+   * Images returned by quantize() are written as 8-bit indexed PNGs, as
+   * long as their pixels haven't changed since
    */
   bool save(const std::string& filename, bool flip = false) const;
 
+  /**
+   * @brief Return a 64-bit hash (xxHash) of the size and pixel data
+   *
+   * Computed while loading and cached until the pixels change through
+   * set(), replace() or markDirty(), or are handed out for writing by
+   * data(), row(), begin() or forEachRow() on a non-const image. Writes
+   * through a pointer kept from earlier must be followed by markDirty()
+   */
+  uint64_t hash() const;
+
   /** @brief Return the image width in pixels
    */
   int width() const;
@@ -65,9 +138,11 @@ class Image {
   /**
    * @brief Return the RGB data
    *
-   * Data will have size width * height * 3 (RGB)
+   * Data will have size width * height * 3 (RGB). The non-const version
+   * is for writing, so it drops the cached hash
    */
-  char* data() const;
+  char* data();
+  const char* data() const;
 
   /**
    * @brief Replace image RGB data
@@ -75,7 +150,7 @@ class Image {
    * @param height The new image height
    *
    * This call will replace the old data with the new data. Data should
-   * match the size width * height * 3
+   * match the size width * height * 3. The whole image is recorded as dirty
    */
   void set(int width, int height, unsigned char* data);
 
@@ -113,9 +188,57 @@ class Image {
   */
   void set(int i, const Pixel& c);
 
+  // pixel iterators over the whole image, row by row from the top left.
+  // On a non-const image begin() is for writing and drops the cached hash;
+  // cbegin()/cend() read without doing so
+  typedef Pixel* iterator;
+  typedef const Pixel* const_iterator;
+  iterator begin();
+  iterator end();
+  const_iterator begin() const;
+  const_iterator end() const;
+  const_iterator cbegin() const;
+  const_iterator cend() const;
+
+  /**
+   * @brief Return the pixels of one row, left to right
+   * @param y The row (value between 0 and height-1)
+   *
+   * Use this instead of get/set in per-pixel loops: the row offset is
+   * computed once and the loop body is plain array access. Like set(),
+   * writes through the span are not recorded; call markDirty() for them.
+   * The non-const row() drops the cached hash, so loops that only read a
+   * non-const image should use crow()
+   */
+  PixelSpan<Pixel> row(int y);
+  PixelSpan<const Pixel> row(int y) const;
+  PixelSpan<const Pixel> crow(int y) const;
+
+  /**
+   * @brief Call fn(y, row(y)) for every row, with rows split across threads
+   *
+   * Calls for different rows may run at the same time, so fn should only
+   * write to the row it is given (or to other per-row state)
+   */
+  void forEachRow(const std::function<void(int, PixelSpan<Pixel>)>& fn);
+  void forEachRow(
+      const std::function<void(int, PixelSpan<const Pixel>)>& fn) const;
+
   // resize the image
   Image resize(int width, int height) const;
 
+  // resize the image, sampling from the smallest level of the given pyramid
+  // (see buildPyramid) that is still at least (width, height); falls back to
+  // this image if no level is large enough
+  Image resize(int width, int height, const std::vector<Image>& pyramid) const;
+
+  // build a chain of successively 2x-downsampled images in one cascade:
+  // level 0 is half this size, level 1 a quarter, and so on, stopping once a
+  // level would be smaller than minSize on either side. The result can be
+  // kept alongside the source and reused for every resize
+  std::vector<Image> buildPyramid(int minSize = 1,
+      PyramidFilter filter = BOX_FILTER) const;
+
   // flip around the horizontal midline
   Image flipHorizontal() const;
 
@@ -127,8 +250,20 @@ class Image {
 
   // Replace the portion starting at (row, col) with the given image
   // Clamps the image if it doesn't fit on this image
+  // The replaced area is recorded as dirty (see dirtyRegions)
   void replace(const Image& image, int x, int y);
 
+  // Record that the w x h area at (x, y) changed, e.g. after a brush stroke
+  // drawn with set(). Overlapping or touching areas are merged
+  void markDirty(int x, int y, int w, int h);
+
+  // Areas changed since the last clearDirty(), so that a Pipeline can
+  // recompute only what they affect
+  const std::vector<Rect>& dirtyRegions() const;
+
+  // Forget all dirty areas
+  void clearDirty();
+
   // Apply gamma correction
   Image gammaCorrect(float gamma) const;
 
@@ -136,7 +271,10 @@ class Image {
   // our image and the given image:
   //    this.pixels = this.pixels * (1-alpha) + other.pixel * alpha
   // Assumes that the two images are the same size
-  Image alphaBlend(const Image& other, float alpha) const;
+  // If linearLight is true the blend happens on linear (decoded sRGB)
+  // values, which avoids the dark fringes of blending gamma-encoded values
+  Image alphaBlend(const Image& other, float alpha,
+      bool linearLight = false) const;
 
   // Convert the image to grayscale
   Image grayscale() const;
@@ -144,32 +282,57 @@ class Image {
   // rotate the Image 90 degrees counter-clockwise
   Image rotate90() const;
 
+  // Warp the image with an affine transform into a (width x height) image.
+  // matrix = {a, b, c, d, e, f} maps every output pixel (x = col, y = row)
+  // back to the source position
+  //    (a * x + b * y + c, d * x + e * y + f)
+  // Source positions outside the image are black (BORDER_CONSTANT) or
+  // take the nearest edge pixel (BORDER_REPLICATE)
+  Image warpAffine(const float* matrix, int width, int height,
+      Interpolation interpolation = BILINEAR,
+      BorderMode border = BORDER_CONSTANT) const;
+
+  // rotate the Image by angle degrees counter-clockwise about its center,
+  // keeping the same size (e.g. to deskew a scanned page)
+  Image rotate(float angle, Interpolation interpolation = BILINEAR) const;
+
+  // scale by (sx, sy) and then translate by (tx, ty) pixels, keeping the
+  // same size; returns a copy if either scale is zero
+  Image scaleTranslate(float sx, float sy, float tx, float ty,
+      Interpolation interpolation = BILINEAR) const;
+
   // Apply the following calculation to the pixels in
   // our image and the given image:
   //    result.pixel = this.pixel + other.pixel
   // with clamp at 255
   // Assumes that the two images are the same size
-  Image add(const Image& other) const;
+  // If linearLight is true, the sum is taken on linear light values (see
+  // alphaBlend), so adding light behaves physically
+  Image add(const Image& other, bool linearLight = false) const;
 
   // Apply the following calculation to the pixels in
   // our image and the given image:
   //    result.pixel = this.pixel - other.pixel
   // with clamp at 0
   // Assumes that the two images are the same size
-  Image subtract(const Image& other) const;
+  // If linearLight is true, linear light values are subtracted instead
+  Image subtract(const Image& other, bool linearLight = false) const;
 
   // Apply the following calculation to the pixels in
   // our image and the given image:
   //    result.pixel = this.pixel * other.pixel
   // with clamp at 255
   // Assumes that the two images are the same size
-  Image multiply(const Image& other) const;
+  // If linearLight is true, both are linear light values in [0, 1] and the
+  // product is the usual multiply blend (white leaves the other unchanged)
+  Image multiply(const Image& other, bool linearLight = false) const;
 
   // Apply the following calculation to the pixels in
   // our image and the given image:
   //    result.pixel = abs(this.pixel - other.pixel)
   // Assumes that the two images are the same size
-  Image difference(const Image& other) const;
+  // If linearLight is true, the difference is taken on linear light values
+  Image difference(const Image& other, bool linearLight = false) const;
 
   // swirl the colors
   Image swirl() const;
@@ -177,13 +340,15 @@ class Image {
   // Apply the following calculation to the pixels in
   // our image and the given image:
   //    result.pixel = max(this.pixel, other.pixel)
-  // Assumes that the two images are the same size
+  // Assumes that the two images are the same size. sRGB encoding keeps
+  // the order of values, so this is the same in linear light
   Image lightest(const Image& other) const;
 
   // Apply the following calculation to the pixels in
   // our image and the given image:
   //    result.pixel = min(this.pixel, other.pixel)
-  // Assumes that the two images are the same size
+  // Assumes that the two images are the same size (same in linear light,
+  // as for lightest)
   Image darkest(const Image& other) const;
 
   // subtract each color channel from the max value 255.
@@ -198,11 +363,37 @@ class Image {
   // box blur image with convolution
   Image blur() const;
 
+  // gaussian blur with standard deviation sigma (in pixels); uses a
+  // recursive (IIR) approximation, so the cost does not grow with sigma
+  Image gaussianBlur(float sigma) const;
+
   // convert pixel to white if at or above threshold, else convert to black
   Image extractWhite(int threshold) const;
 
-  // add glow effect to image (extractWhite + alphaBlend)
-  Image glow(int threshold) const;
+  // median filter over a (2 * radius + 1)^2 window (edges replicated),
+  // per channel; removes salt-and-pepper noise without smearing edges.
+  // Cost does not depend on the radius, which is limited to the larger
+  // side of the image
+  Image median(int radius) const;
+
+  // morphological dilation: each channel becomes the max over a
+  // (2 * radius + 1) x (2 * radiusY + 1) rectangle (radiusY < 0 means the
+  // same as radius); cost does not depend on the radius
+  Image dilate(int radius, int radiusY = -1) const;
+
+  // morphological erosion: like dilate, but takes the min
+  Image erode(int radius, int radiusY = -1) const;
+
+  // morphological opening (erode then dilate), removes small bright specks
+  Image open(int radius, int radiusY = -1) const;
+
+  // morphological closing (dilate then erode), fills small dark holes
+  Image close(int radius, int radiusY = -1) const;
+
+  // add glow effect to image: pixels at or above threshold are box blurred
+  // over a (2 * radius + 1)^2 window and blended back over the image.
+  // Runs as one row sweep over a single 8-bit mask (no full-size temporaries)
+  Image glow(int threshold, int radius = 1) const;
 
   // sobel edge detection
   Image sobelEdge() const;
@@ -210,6 +401,28 @@ class Image {
   // averages a 3x3 neighborhood of pixels and colors them all the same
   Image bitMap() const;
 
+  // reduce the image to at most colors (2 to 256) colors, picked by median
+  // cut over a sampled histogram, with optional dithering. The result keeps
+  // its palette, so save() writes it as an 8-bit indexed PNG
+  Image quantize(int colors, Dither dither = DITHER_NONE) const;
+
+  // the palette set by quantize(), or empty for a regular RGB image
+  const std::vector<Pixel>& palette() const;
+
+  // build a summed-area table of this image (see SummedAreaTable)
+  SummedAreaTable summedAreaTable() const;
+
+  // replace every blockW x blockH block with its average color; covers the
+  // whole image, including partial blocks along the right and bottom edges
+  Image pixelate(int blockW, int blockH) const;
+
+  // pixelate only the w x h region with top-left (x, y), in place, using a
+  // summed-area table built from this image (e.g. to redact a detection);
+  // does nothing if the table's size differs from the image's. The
+  // pixelated area is recorded as dirty (see dirtyRegions)
+  void pixelate(const SummedAreaTable& table, int x, int y, int w, int h,
+      int blockW, int blockH);
+
  private:
   int _width = 0;  // number of columns (in pixels)
   int _height = 0;  // number of rows (in pixels)
@@ -217,10 +430,23 @@ class Image {
   // internally use struct Pixel *, externally accept/return as unsigned char *
   struct Pixel * _pixels = NULL;  // internal representation of pixel data
   bool _use_stbi_free = false;  // use stbi_image_free instead of delete
+  std::vector<Pixel> _palette;  // colors of a quantized image, else empty
+  std::vector<unsigned char> _indices;  // palette index of every pixel
+  uint64_t _indicesHash = 0;  // hash() of the pixels _indices describe
+  std::vector<Rect> _dirty;  // changed areas, see markDirty
+  mutable uint64_t _hash = 0;  // cached result of hash()
+  mutable bool _hashValid = false;  // false once the pixels change
 
   // free memory pointed to by _pixels
   void resetPixels();
 
+  // write an 8-bit indexed PNG from _palette and _indices; fails (without
+  // writing) if the pixels changed since quantize
+  bool saveIndexed(const std::string& filename, bool flip) const;
+
+  // downsample by 2 in each direction (rounding odd sizes up)
+  Image halve(PyramidFilter filter) const;
+
   // apply a 3x3 matrix to a pixel and return convolution with pixel at (i,j),
   // with component-wise sums in the result matrix
   int* convolve(const int * matrix, int * result, int i, int j,
@@ -231,5 +457,116 @@ class Image {
   Pixel alphaBlendPixel(const struct Pixel& orig, const struct Pixel& other,
       float alpha) const;
 };
+
+// how stackReduce combines the pixels of a stack of images
+enum ReduceMode {REDUCE_MEAN, REDUCE_WEIGHTED_MEAN, REDUCE_MAX, REDUCE_MIN,
+    REDUCE_MEDIAN, REDUCE_SUM};
+
+// Combine a stack of images pixel by pixel, e.g. for exposure stacking or
+// temporal denoising. Sums are accumulated in wide integers and rounded or
+// clamped once, and only the output image is allocated. weights (one per
+// image) are only used by REDUCE_WEIGHTED_MEAN. REDUCE_SUM clamps at 255.
+// Assumes that all images are the same size
+Image stackReduce(const std::vector<const Image*>& images, ReduceMode mode,
+    const std::vector<float>& weights = std::vector<float>());
+
+/**
+ * @brief Summed-area table (integral image) of an Image
+ *
+ * Stores 32-bit per-channel sums, so any rectangle sum or mean costs four
+ * lookups. Sums wrap around on large images, but the wrapped differences
+ * are still exact for any rectangle whose true sum fits in 32 bits (about
+ * 16.8 million pixels); larger queries are split into bands of rows.
+ */
+class SummedAreaTable {
+ public:
+  SummedAreaTable();
+  explicit SummedAreaTable(const Image& image);
+
+  /** @brief Return the width of the source image in pixels
+   */
+  int width() const;
+
+  /** @brief Return the height of the source image in pixels
+   */
+  int height() const;
+
+  // component-wise sums over the w x h rectangle with top-left (x, y),
+  // clipped to the image; sums must hold 3 values
+  void regionSum(int x, int y, int w, int h, uint64_t* sums) const;
+
+  // average color of the w x h rectangle with top-left (x, y), clipped to
+  // the image (black if nothing is left after clipping)
+  Pixel regionMean(int x, int y, int w, int h) const;
+
+ private:
+  int _width = 0;
+  int _height = 0;
+  // (width + 1) x (height + 1) x 3 sums; first row and column are zero
+  std::vector<uint32_t> _sums;
+
+  // sums over a rectangle already clipped and small enough not to overflow
+  void bandSum(int x, int y, int w, int h, uint64_t* sums) const;
+};
+
+// per-pixel accessors are inline, so loops over them compile to direct
+// array access
+
+inline Pixel Image::get(int row, int col) const {
+  return _pixels[row * _width + col];
+}
+
+inline void Image::set(int row, int col, const Pixel& color) {
+  _pixels[row * _width + col] = color;
+  _hashValid = false;
+}
+
+inline Pixel Image::get(int i) const {
+  return _pixels[i];
+}
+
+inline void Image::set(int i, const Pixel& c) {
+  _pixels[i] = c;
+  _hashValid = false;
+}
+
+inline Image::iterator Image::begin() {
+  _hashValid = false;
+  return _pixels;
+}
+
+inline Image::iterator Image::end() {
+  return _pixels + _width * _height;
+}
+
+inline Image::const_iterator Image::begin() const {
+  return _pixels;
+}
+
+inline Image::const_iterator Image::end() const {
+  return _pixels + _width * _height;
+}
+
+inline Image::const_iterator Image::cbegin() const {
+  return _pixels;
+}
+
+inline Image::const_iterator Image::cend() const {
+  return _pixels + _width * _height;
+}
+
+inline PixelSpan<Pixel> Image::row(int y) {
+  _hashValid = false;
+  return PixelSpan<Pixel>(_pixels + y * _width, _width);
+}
+
+inline PixelSpan<const Pixel> Image::row(int y) const {
+  return PixelSpan<const Pixel>(_pixels + y * _width, _width);
+}
+
+inline PixelSpan<const Pixel> Image::crow(int y) const {
+  return row(y);
+}
+
 }  // namespace agl
 #endif  // AGL_IMAGE_H_
@@ -0,0 +1,107 @@
+/* kernels.h
+ * 3x3 convolution kernels with their coefficients as template parameters,
+ * so the compiler unrolls every tap, drops the zero ones and turns the
+ * others into shifts and adds (see Image::convolve for the runtime path)
+ */
+
+#ifndef AGL_KERNELS_H_
+#define AGL_KERNELS_H_
+
+#include <algorithm>
+#include "image.h"
+#include "parallel.h"
+
+namespace agl {
+
+/**
+ * @brief A 3x3 kernel known at compile time
+ *
+ * Coefficients are given row by row. Filtered values are the weighted sum,
+ * divided by Divisor (rounding half away from zero) plus Offset, clamped
+ * to [0, 255].
+ */
+template <int K00, int K01, int K02, int K10, int K11, int K12, int K20,
+    int K21, int K22, int Divisor = 1, int Offset = 0>
+struct Kernel3x3 {
+  // coefficient at row m, column n (both 0 to 2)
+  static constexpr int at(int m, int n) {
+    return m == 0 ? (n == 0 ? K00 : n == 1 ? K01 : K02) :
+        m == 1 ? (n == 0 ? K10 : n == 1 ? K11 : K12) :
+        (n == 0 ? K20 : n == 1 ? K21 : K22);
+  }
+
+  // Weighted sum around one channel value of an interleaved RGB row:
+  // above, here and below point at the same channel of the center pixel
+  // in three consecutive rows, so neighbours are 3 bytes away
+  static inline int sum(const unsigned char* above, const unsigned char* here,
+      const unsigned char* below) {
+    return K00 * above[-3] + K01 * above[0] + K02 * above[3] +
+        K10 * here[-3] + K11 * here[0] + K12 * here[3] +
+        K20 * below[-3] + K21 * below[0] + K22 * below[3];
+  }
+
+  // sum divided, offset and clamped to a channel value
+  static inline unsigned char scale(int sum) {
+    int value = Divisor == 1 ? sum : sum >= 0 ?
+        (sum + Divisor / 2) / Divisor : -((Divisor / 2 - sum) / Divisor);
+    return (unsigned char) std::min(std::max(value + Offset, 0), 255);
+  }
+};
+
+// common kernels
+typedef Kernel3x3<1, 1, 1, 1, 1, 1, 1, 1, 1, 9> BoxKernel;
+typedef Kernel3x3<-1, 0, 1, -2, 0, 2, -1, 0, 1> SobelXKernel;
+typedef Kernel3x3<-1, -2, -1, 0, 0, 0, 1, 2, 1> SobelYKernel;
+typedef Kernel3x3<-3, 0, 3, -10, 0, 10, -3, 0, 3> ScharrXKernel;
+typedef Kernel3x3<-3, -10, -3, 0, 0, 0, 3, 10, 3> ScharrYKernel;
+typedef Kernel3x3<0, 1, 0, 1, -4, 1, 0, 1, 0> LaplacianKernel;
+typedef Kernel3x3<0, -1, 0, -1, 5, -1, 0, -1, 0> SharpenKernel;
+typedef Kernel3x3<-2, -1, 0, -1, 1, 1, 0, 1, 2> EmbossKernel;
+
+// Filter image with a compile time kernel. Pixels outside the image repeat
+// the nearest edge pixel. Gradient kernels (Sobel, Scharr, Laplacian) give
+// signed sums, so pick an Offset (e.g. 128) to keep the negative half
+template <class Kernel>
+Image filter(const Image& image) {
+  int width = image.width();
+  int height = image.height();
+  Image result(width, height);
+  if (width == 0 || height == 0) {
+    return result;
+  }
+  const unsigned char* in = (const unsigned char*) image.data();
+  unsigned char* out = (unsigned char*) result.data();
+  int rowBytes = width * 3;
+  parallelFor(height, [=](int begin, int end) {
+    int bytes = rowBytes;  // local, so stores to out can't change it
+    for (int i = begin; i < end; i++) {
+      const unsigned char* above = in + std::max(i - 1, 0) * bytes;
+      const unsigned char* here = in + i * bytes;
+      const unsigned char* below = in + std::min(i + 1, height - 1) * bytes;
+      unsigned char* dst = out + i * bytes;
+      // interior columns: straight line code over all channels
+      for (int k = 3; k < bytes - 3; k++) {
+        dst[k] = Kernel::scale(Kernel::sum(above + k, here + k, below + k));
+      }
+      // first and last column repeat the edge pixel
+      for (int j = 0; j < width; j += std::max(width - 1, 1)) {
+        int left = std::max(j - 1, 0) * 3;
+        int right = std::min(j + 1, width - 1) * 3;
+        const unsigned char* rows[3] = {above, here, below};
+        for (int c = 0; c < 3; c++) {
+          int sum = 0;
+          for (int m = 0; m < 3; m++) {
+            sum += Kernel::at(m, 0) * rows[m][left + c] +
+                Kernel::at(m, 1) * rows[m][j * 3 + c] +
+                Kernel::at(m, 2) * rows[m][right + c];
+          }
+          dst[j * 3 + c] = Kernel::scale(sum);
+        }
+      }
+    }
+  });
+  return result;
+}
+
+}  // namespace agl
+#endif  // AGL_KERNELS_H_
@@ -0,0 +1,236 @@
+/* metrics.cpp
+ * Implementation of the image comparison metrics declared in metrics.h.
+ * Every metric is split across threads by rows; SSIM reads its window
+ * statistics from integral images built per band of rows
+ */
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <vector>
+#include "parallel.h"
+
+namespace agl {
+
+// sum of squared differences and largest absolute difference of a range
+// of bytes; squares are summed in 32 bits over blocks short enough that
+// they cannot overflow, which keeps the loop vectorizable
+static void errorStats(const unsigned char* a, const unsigned char* b,
+    int count, uint64_t& sumSquares, int& maxError) {
+  const int kBlock = 4096;  // 4096 * 255^2 < 2^32
+  int largest = maxError;
+  for (int start = 0; start < count; start += kBlock) {
+    int end = std::min(start + kBlock, count);
+    uint32_t sum = 0;
+    for (int k = start; k < end; k++) {
+      int d = std::abs(a[k] - b[k]);
+      sum += d * d;
+      largest = std::max(largest, d);
+    }
+    sumSquares += sum;
+  }
+  maxError = largest;
+}
+
+// sum of squared differences and largest error over both whole images
+static void errorStats(const Image& a, const Image& b,
+    uint64_t& sumSquares, int& maxError) {
+  const unsigned char* pa = (const unsigned char*) a.data();
+  const unsigned char* pb = (const unsigned char*) b.data();
+  int rowBytes = a.width() * 3;
+  std::mutex mutex;
+  sumSquares = 0;
+  maxError = 0;
+  parallelFor(a.height(), [&](int begin, int end) {
+    uint64_t sum = 0;
+    int largest = 0;
+    errorStats(pa + (size_t) begin * rowBytes, pb + (size_t) begin * rowBytes,
+        (end - begin) * rowBytes, sum, largest);
+    std::lock_guard<std::mutex> lock(mutex);
+    sumSquares += sum;
+    maxError = std::max(maxError, largest);
+  });
+}
+
+static double psnrFromMse(double mse) {
+  if (mse == 0) {
+    return std::numeric_limits<double>::infinity();
+  }
+  return 10 * std::log10(255.0 * 255.0 / mse);
+}
+
+double meanSquaredError(const Image& a, const Image& b) {
+  size_t count = (size_t) a.width() * a.height() * 3;
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t sumSquares;
+  int maxError;
+  errorStats(a, b, sumSquares, maxError);
+  return (double) sumSquares / count;
+}
+
+double psnr(const Image& a, const Image& b) {
+  return psnrFromMse(meanSquaredError(a, b));
+}
+
+int maxAbsError(const Image& a, const Image& b) {
+  uint64_t sumSquares;
+  int maxError;
+  errorStats(a, b, sumSquares, maxError);
+  return maxError;
+}
+
+// luma of one row of pixels, with the weights used by Image::grayscale
+static void lumaRow(const Pixel* row, int width, uint32_t* out) {
+  for (int j = 0; j < width; j++) {
+    out[j] = (19661 * row[j].r + 38666 * row[j].g + 7209 * row[j].b +
+        32768) >> 16;
+  }
+}
+
+double ssim(const Image& a, const Image& b, int window) {
+  int width = a.width();
+  int height = a.height();
+  // up to 256x256 windows keep every window sum below 2^32
+  window = std::max(1, std::min(std::min(window, 256),
+      std::min(width, height)));
+  if (width == 0 || height == 0) {
+    return 1;
+  }
+  // window positions, by their top left corner
+  int windowsX = width - window + 1;
+  int windowsY = height - window + 1;
+
+  // Each band of window rows builds integral images of x, y, x^2, y^2 and
+  // xy over just the input rows it needs. Sums wrap around in 32 bits, but
+  // a window's sum (at most 64 * 255^2 for 8x8) fits, so the wrapped
+  // differences are exact
+  const int kBandRows = 64;
+  int bands = (windowsY + kBandRows - 1) / kBandRows;
+  const double n = (double) window * window;
+  const double c1 = (0.01 * 255) * (0.01 * 255);
+  const double c2 = (0.03 * 255) * (0.03 * 255);
+  const Pixel* pa = (const Pixel*) a.data();
+  const Pixel* pb = (const Pixel*) b.data();
+  std::mutex mutex;
+  double total = 0;
+
+  parallelFor(bands, [&](int beginBand, int endBand) {
+    int stride = width + 1;
+    int maxRows = kBandRows + window - 1;
+    std::vector<uint32_t> tables(5 * (size_t) stride * (maxRows + 1), 0);
+    uint32_t* sumX = tables.data();
+    uint32_t* sumY = sumX + (size_t) stride * (maxRows + 1);
+    uint32_t* sumXX = sumY + (size_t) stride * (maxRows + 1);
+    uint32_t* sumYY = sumXX + (size_t) stride * (maxRows + 1);
+    uint32_t* sumXY = sumYY + (size_t) stride * (maxRows + 1);
+    std::vector<uint32_t> lumaA(width);
+    std::vector<uint32_t> lumaB(width);
+    double partial = 0;
+
+    for (int band = beginBand; band < endBand; band++) {
+      int y0 = band * kBandRows;
+      int y1 = std::min(y0 + kBandRows, windowsY);
+      int rows = y1 - y0 + window - 1;
+
+      // row 0 and column 0 of every table stay zero
+      for (int r = 0; r < rows; r++) {
+        lumaRow(pa + (size_t) (y0 + r) * width, width, lumaA.data());
+        lumaRow(pb + (size_t) (y0 + r) * width, width, lumaB.data());
+        size_t above = (size_t) r * stride;
+        size_t here = above + stride;
+        uint32_t x = 0, y = 0, xx = 0, yy = 0, xy = 0;
+        for (int j = 0; j < width; j++) {
+          uint32_t p = lumaA[j];
+          uint32_t q = lumaB[j];
+          x += p;
+          y += q;
+          xx += p * p;
+          yy += q * q;
+          xy += p * q;
+          sumX[here + j + 1] = sumX[above + j + 1] + x;
+          sumY[here + j + 1] = sumY[above + j + 1] + y;
+          sumXX[here + j + 1] = sumXX[above + j + 1] + xx;
+          sumYY[here + j + 1] = sumYY[above + j + 1] + yy;
+          sumXY[here + j + 1] = sumXY[above + j + 1] + xy;
+        }
+      }
+
+      for (int r = 0; r < y1 - y0; r++) {
+        size_t top = (size_t) r * stride;
+        size_t bottom = (size_t) (r + window) * stride;
+        for (int j = 0; j < windowsX; j++) {
+          size_t tl = top + j, tr = top + j + window;
+          size_t bl = bottom + j, br = bottom + j + window;
+          auto box = [=](const uint32_t* table) {
+            return (uint32_t) (table[br] - table[bl] - table[tr] + table[tl]);
+          };
+          double mx = box(sumX) / n;
+          double my = box(sumY) / n;
+          double vx = box(sumXX) / n - mx * mx;
+          double vy = box(sumYY) / n - my * my;
+          double cov = box(sumXY) / n - mx * my;
+          partial += ((2 * mx * my + c1) * (2 * cov + c2)) /
+              ((mx * mx + my * my + c1) * (vx + vy + c2));
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    total += partial;
+  }, 1);
+  return total / ((double) windowsX * windowsY);
+}
+
+ImageDifference compare(const Image& a, const Image& b, int window) {
+  ImageDifference result;
+  size_t count = (size_t) a.width() * a.height() * 3;
+  uint64_t sumSquares;
+  errorStats(a, b, sumSquares, result.maxError);
+  result.mse = count == 0 ? 0 : (double) sumSquares / count;
+  result.psnr = psnrFromMse(result.mse);
+  // equal images skip the ssim pass
+  result.ssim = result.maxError == 0 ? 1 : ssim(a, b, window);
+  return result;
+}
+
+bool equalWithin(const Image& a, const Image& b, int tolerance) {
+  if (a.width() != b.width() || a.height() != b.height()) {
+    return false;
+  }
+  const unsigned char* pa = (const unsigned char*) a.data();
+  const unsigned char* pb = (const unsigned char*) b.data();
+  size_t rowBytes = (size_t) a.width() * 3;
+  std::atomic<bool> differ(false);
+  parallelFor(a.height(), [&](int begin, int end) {
+    for (int i = begin; i < end && !differ.load(std::memory_order_relaxed);
+        i++) {
+      const unsigned char* ra = pa + i * rowBytes;
+      const unsigned char* rb = pb + i * rowBytes;
+      bool rowDiffers;
+      if (tolerance <= 0) {
+        rowDiffers = memcmp(ra, rb, rowBytes) != 0;
+      } else {
+        // whole row without branching, so the loop vectorizes
+        int largest = 0;
+        for (size_t k = 0; k < rowBytes; k++) {
+          largest = std::max(largest, std::abs(ra[k] - rb[k]));
+        }
+        rowDiffers = largest > tolerance;
+      }
+      if (rowDiffers) {
+        differ.store(true, std::memory_order_relaxed);
+      }
+    }
+  });
+  return !differ.load();
+}
+
+}  // namespace agl
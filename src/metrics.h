@@ -0,0 +1,49 @@
+/* metrics.h
+ * Summary numbers for comparing two images, e.g. an operator's output
+ * against a reference render
+ */
+
+#ifndef AGL_METRICS_H_
+#define AGL_METRICS_H_
+
+#include "image.h"
+
+namespace agl {
+
+// all comparison numbers for a pair of images (see compare)
+struct ImageDifference {
+  double mse;     // mean squared error over all channels
+  double psnr;    // peak signal to noise ratio in dB, infinity if equal
+  int maxError;   // largest absolute difference of any channel
+  double ssim;    // mean structural similarity of the luma, 1 if equal
+};
+
+// Mean squared error over the r, g and b channels of every pixel
+// Assumes that both images are the same size
+double meanSquaredError(const Image& a, const Image& b);
+
+// Peak signal to noise ratio 10 log10(255^2 / mse) in dB; infinity for
+// identical images. Assumes that both images are the same size
+double psnr(const Image& a, const Image& b);
+
+// Largest absolute difference between any two channels
+// Assumes that both images are the same size
+int maxAbsError(const Image& a, const Image& b);
+
+// Mean structural similarity (SSIM) of the luma of both images, over every
+// window x window box, with box statistics read from 32-bit integral
+// images built per band of rows. Ranges up to 1 for identical images.
+// window is clamped to the image size and to 256
+// Assumes that both images are the same size
+double ssim(const Image& a, const Image& b, int window = 8);
+
+// All of the above, sharing one pass for mse, psnr and maxError
+ImageDifference compare(const Image& a, const Image& b, int window = 8);
+
+// True if both images have the same size and no channel differs by more
+// than tolerance. Stops at the first row that is off, so differing images
+// are rejected quickly
+bool equalWithin(const Image& a, const Image& b, int tolerance = 0);
+
+}  // namespace agl
+#endif  // AGL_METRICS_H_
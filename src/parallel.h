@@ -0,0 +1,160 @@
+/* parallel.h
+ * Small helper for splitting row (or tile) loops across threads
+ */
+
+#ifndef AGL_PARALLEL_H_
+#define AGL_PARALLEL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace agl {
+
+/**
+ * @brief Worker threads shared by every parallelFor call
+ *
+ * Started on first use and kept until exit, so short loops (and long
+ * running processes like pixmap_server) don't pay for thread startup on
+ * every call. The calling thread works on its own job too, which keeps
+ * nested calls from a worker from waiting on themselves.
+ */
+class ThreadPool {
+ public:
+  static ThreadPool& instance() {
+    static ThreadPool pool;
+    return pool;
+  }
+
+  // number of threads a job can use, including the calling thread
+  int size() const {
+    return (int) _workers.size() + 1;
+  }
+
+  // run fn(k) for every k in [0, count) and wait for all of them; the
+  // first exception thrown by any item is rethrown here, on the caller
+  void run(int count, const std::function<void(int)>& fn) {
+    std::shared_ptr<Job> job = std::make_shared<Job>(fn, count);
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _jobs.push_back(job);
+    }
+    _wake.notify_all();
+    work(*job);
+    std::unique_lock<std::mutex> lock(_mutex);
+    retire(job);
+    _finished.wait(lock, [&] { return job->done == count; });
+    if (job->error) {
+      std::rethrow_exception(job->error);
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _wake.notify_all();
+    for (std::thread& worker : _workers) {
+      worker.join();
+    }
+  }
+
+ private:
+  struct Job {
+    Job(const std::function<void(int)>& fn, int count): fn(fn),
+        count(count) {  }
+    const std::function<void(int)>& fn;
+    int count;
+    std::atomic<int> next{0};  // next item to hand out
+    std::atomic<int> done{0};  // items finished
+    std::exception_ptr error;  // first exception thrown, set under _mutex
+  };
+
+  std::vector<std::thread> _workers;
+  std::vector<std::shared_ptr<Job>> _jobs;  // jobs with items left
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::condition_variable _finished;
+  bool _stop = false;
+
+  ThreadPool() {
+    int threads = (int) std::thread::hardware_concurrency();
+    for (int i = 1; i < threads; i++) {
+      _workers.emplace_back([this] { loop(); });
+    }
+  }
+
+  // take items of job until none are left
+  void work(Job& job) {
+    for (int k = job.next++; k < job.count; k = job.next++) {
+      // an exception escaping a worker thread would terminate the process
+      try {
+        job.fn(k);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!job.error) {
+          job.error = std::current_exception();
+        }
+      }
+      if (++job.done == job.count) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _finished.notify_all();
+      }
+    }
+  }
+
+  // drop job from the queue; called with _mutex held
+  void retire(const std::shared_ptr<Job>& job) {
+    auto found = std::find(_jobs.begin(), _jobs.end(), job);
+    if (found != _jobs.end()) {
+      _jobs.erase(found);
+    }
+  }
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+      _wake.wait(lock, [this] { return _stop || !_jobs.empty(); });
+      if (_stop) {
+        return;
+      }
+      std::shared_ptr<Job> job = _jobs.front();
+      lock.unlock();
+      work(*job);
+      lock.lock();
+      retire(job);
+    }
+  }
+};
+
+// Run fn(begin, end) on contiguous chunks of [0, count), one chunk per
+// hardware thread. Each chunk holds at least minChunk items so small images
+// stay on the calling thread instead of waking the pool.
+inline void parallelFor(int count, const std::function<void(int, int)>& fn,
+    int minChunk = 16) {
+  if (count <= 0) {
+    return;
+  }
+  int threads = (int) std::thread::hardware_concurrency();
+  threads = std::max(1, std::min(threads,
+      (count + minChunk - 1) / std::max(minChunk, 1)));
+  if (threads == 1) {
+    fn(0, count);
+    return;
+  }
+  int chunk = (count + threads - 1) / threads;
+  int chunks = (count + chunk - 1) / chunk;
+  ThreadPool::instance().run(chunks, [&](int k) {
+    fn(k * chunk, std::min((k + 1) * chunk, count));
+  });
+}
+
+}  // namespace agl
+#endif  // AGL_PARALLEL_H_
@@ -0,0 +1,269 @@
+/* pipeline.cpp
+ * Implementation of Pipeline: whole-image runs and incremental updates of
+ * dirty regions
+ */
+
+#include "pipeline.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <sstream>
+#include "hash.h"
+
+namespace agl {
+
+// Largest halo of a stage, and of a whole pipeline: past the side of any
+// image we handle, and small enough that adding it to coordinates can't
+// overflow
+static const int kMaxHalo = 1 << 28;
+
+// largest parameters parse() accepts, since its text may come from an
+// untrusted client (see pixmap_server)
+static const float kMaxRadius = 4096;
+static const float kMaxSigma = 256;
+
+Pipeline& Pipeline::add(const std::string& name,
+    const std::function<Image(const Image&)>& op, int halo) {
+  _stages.push_back(Stage{name, op, std::min(std::max(halo, 0), kMaxHalo)});
+  return *this;
+}
+
+Pipeline& Pipeline::grayscale() {
+  return add("grayscale", [](const Image& image) {
+    return image.grayscale();
+  }, 0);
+}
+
+Pipeline& Pipeline::invert() {
+  return add("invert", [](const Image& image) {
+    return image.invert();
+  }, 0);
+}
+
+Pipeline& Pipeline::blur() {
+  return add("blur", [](const Image& image) {
+    return image.blur();
+  }, 1);
+}
+
+Pipeline& Pipeline::sobelEdge() {
+  return add("sobelEdge", [](const Image& image) {
+    return image.sobelEdge();
+  }, 1);
+}
+
+Pipeline& Pipeline::glow(int threshold, int radius) {
+  std::ostringstream name;
+  name << "glow(" << threshold << "," << radius << ")";
+  return add(name.str(), [=](const Image& image) {
+    return image.glow(threshold, radius);
+  }, radius);
+}
+
+Pipeline& Pipeline::gaussianBlur(float sigma) {
+  std::ostringstream name;
+  name << "gaussianBlur(" << sigma << ")";
+  // The recursive filter never quite reaches zero, so any cut-off can flip
+  // the rounding of an output that lies right at a half. 4 sigma did so on
+  // most updates; past 16 sigma the weights are below float resolution and
+  // updates matched full runs in every case tried
+  return add(name.str(), [=](const Image& image) {
+    return image.gaussianBlur(sigma);
+  }, (int) fmin(ceil(16.0 * sigma), kMaxHalo));
+}
+
+Pipeline& Pipeline::median(int radius) {
+  std::ostringstream name;
+  name << "median(" << radius << ")";
+  return add(name.str(), [=](const Image& image) {
+    return image.median(radius);
+  }, radius);
+}
+
+Pipeline& Pipeline::dilate(int radius) {
+  std::ostringstream name;
+  name << "dilate(" << radius << ")";
+  return add(name.str(), [=](const Image& image) {
+    return image.dilate(radius);
+  }, radius);
+}
+
+Pipeline& Pipeline::erode(int radius) {
+  std::ostringstream name;
+  name << "erode(" << radius << ")";
+  return add(name.str(), [=](const Image& image) {
+    return image.erode(radius);
+  }, radius);
+}
+
+bool Pipeline::parse(const std::string& text) {
+  std::string spaced = text;
+  std::replace(spaced.begin(), spaced.end(), '|', ' ');
+  std::istringstream stages(spaced);
+  std::string stage;
+  while (stages >> stage) {
+    // split "name(a,b)" into the name and its numeric arguments
+    std::string name = stage.substr(0, stage.find('('));
+    std::vector<float> args;
+    if (name.size() < stage.size()) {
+      if (stage.back() != ')') {
+        return false;
+      }
+      std::istringstream list(stage.substr(name.size() + 1,
+          stage.size() - name.size() - 2));
+      std::string arg;
+      while (std::getline(list, arg, ',')) {
+        char* end;
+        args.push_back(strtof(arg.c_str(), &end));
+        if (arg.empty() || *end != '\0' || !std::isfinite(args.back())) {
+          return false;
+        }
+      }
+    }
+
+    int count = (int) args.size();
+    // bound every argument before it is converted to int or sizes a
+    // window: glow takes a threshold and a radius, the others a radius or
+    // sigma
+    auto inRange = [&](int k, float low, float high) {
+      return k >= count || (args[k] >= low && args[k] <= high);
+    };
+    bool bounded = name == "gaussianBlur" ? inRange(0, 0, kMaxSigma) :
+        name == "glow" ? inRange(0, 0, 256) && inRange(1, 0, kMaxRadius) :
+        inRange(0, 0, kMaxRadius);
+    if (!bounded) {
+      return false;
+    }
+    if (name == "grayscale" && count == 0) {
+      grayscale();
+    } else if (name == "invert" && count == 0) {
+      invert();
+    } else if (name == "blur" && count == 0) {
+      blur();
+    } else if (name == "sobelEdge" && count == 0) {
+      sobelEdge();
+    } else if (name == "glow" && (count == 1 || count == 2)) {
+      glow((int) args[0], count == 2 ? (int) args[1] : 1);
+    } else if (name == "gaussianBlur" && count == 1 && args[0] > 0) {
+      gaussianBlur(args[0]);
+    } else if (name == "median" && count == 1) {
+      median((int) args[0]);
+    } else if (name == "dilate" && count == 1) {
+      dilate((int) args[0]);
+    } else if (name == "erode" && count == 1) {
+      erode((int) args[0]);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+int Pipeline::size() const {
+  return (int) _stages.size();
+}
+
+std::vector<std::string> Pipeline::names() const {
+  std::vector<std::string> result;
+  for (const Stage& stage : _stages) {
+    result.push_back(stage.name);
+  }
+  return result;
+}
+
+int Pipeline::halo() const {
+  int64_t total = 0;
+  for (const Stage& stage : _stages) {
+    total += stage.halo;
+  }
+  return (int) std::min(total, (int64_t) kMaxHalo);
+}
+
+Image Pipeline::run(const Image& input) const {
+  if (_stages.empty()) {
+    Image result = input;
+    result.clearDirty();
+    return result;
+  }
+  // the first stage reads the input directly rather than a copy of it
+  Image result = _stages[0].op(input);
+  for (size_t k = 1; k < _stages.size(); k++) {
+    result = _stages[k].op(result);
+  }
+  result.clearDirty();  // stages may return their input unchanged
+  return result;
+}
+
+uint64_t Pipeline::key(const Image& input) const {
+  std::string chain;
+  for (const Stage& stage : _stages) {
+    chain += stage.name;
+    chain += ';';
+  }
+  return hash64(chain.data(), chain.size(), input.hash());
+}
+
+Image Pipeline::run(const Image& input, ResultCache& cache) const {
+  uint64_t id = key(input);
+  Image result;
+  if (!cache.lookup(id, result)) {
+    result = run(input);
+    cache.store(id, result);
+  }
+  return result;
+}
+
+void Pipeline::update(Image& input, Image& output) const {
+  if (output.width() != input.width() || output.height() != input.height()) {
+    output = run(input);
+    input.clearDirty();
+    return;
+  }
+  int reach = halo();
+  int width = input.width();
+  int height = input.height();
+  // Outputs the changes can affect. Grown areas often overlap (always, for
+  // wide halos like a large gaussianBlur's), so merge them first rather
+  // than recomputing the overlap once per area
+  std::vector<Rect> affected;
+  for (const Rect& dirty : input.dirtyRegions()) {
+    int ax = std::max(dirty.x - reach, 0);
+    int ay = std::max(dirty.y - reach, 0);
+    int aw = std::min(dirty.x + dirty.w + reach, width) - ax;
+    int ah = std::min(dirty.y + dirty.h + reach, height) - ay;
+    mergeRect(affected, Rect{ax, ay, aw, ah});
+  }
+  // ...and the inputs those outputs depend on. Errors from cutting the
+  // input out spread inwards by at most the total halo, so they never
+  // reach the affected area (at the image border the cut is the border)
+  std::vector<Rect> sources;
+  int64_t work = 0;
+  for (const Rect& area : affected) {
+    int sx = std::max(area.x - reach, 0);
+    int sy = std::max(area.y - reach, 0);
+    int sw = std::min(area.x + area.w + reach, width) - sx;
+    int sh = std::min(area.y + area.h + reach, height) - sy;
+    sources.push_back(Rect{sx, sy, sw, sh});
+    work += (int64_t) sw * sh;
+  }
+  // patches that together cover more than half the image cost more than
+  // running over it once (copies, plus the halo recomputed per patch)
+  if (work * 2 > (int64_t) width * height) {
+    output = run(input);
+    input.clearDirty();
+    return;
+  }
+  for (size_t k = 0; k < affected.size(); k++) {
+    const Rect& area = affected[k];
+    const Rect& source = sources[k];
+    Image patch = run(input.subimage(source.x, source.y, source.w,
+        source.h));
+    output.replace(patch.subimage(area.x - source.x, area.y - source.y,
+        area.w, area.h), area.x, area.y);
+  }
+  input.clearDirty();
+}
+
+}  // namespace agl
@@ -0,0 +1,91 @@
+/* pipeline.h
+ * A recorded chain of image operators that can be run on a whole image, or
+ * re-run only where its input changed
+ */
+
+#ifndef AGL_PIPELINE_H_
+#define AGL_PIPELINE_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "image.h"
+#include "result_cache.h"
+
+namespace agl {
+
+/**
+ * @brief Records a chain of size-preserving image operators
+ *
+ * Every stage has a halo: how many pixels a change in its input can spread
+ * in its output (1 for a 3x3 blur, 0 for per-pixel operators). This lets
+ * update() recompute only the areas affected by the input's dirty regions
+ * and patch them into a previously computed output. Stages with a finite
+ * footprint give the same pixels as run(); gaussianBlur has an infinite
+ * one, so its halo is only wide enough that rounding differences (of at
+ * most 1) are very unlikely rather than impossible.
+ */
+class Pipeline {
+ public:
+  // append a stage; op must return an image of the same size, and name
+  // should include any parameters, since results are cached by name
+  Pipeline& add(const std::string& name,
+      const std::function<Image(const Image&)>& op, int halo);
+
+  // append one of the built in operators (see image.h)
+  Pipeline& grayscale();
+  Pipeline& invert();
+  Pipeline& blur();
+  Pipeline& sobelEdge();
+  Pipeline& glow(int threshold, int radius = 1);
+  Pipeline& gaussianBlur(float sigma);
+  Pipeline& median(int radius);
+  Pipeline& dilate(int radius);
+  Pipeline& erode(int radius);
+
+  // Append the stages written in text, in the form names() returns them,
+  // separated by spaces or '|', e.g. "grayscale | gaussianBlur(1.5)".
+  // Returns false at the first unknown stage or bad parameter: one that
+  // is not a finite number, a radius outside [0, 4096], a sigma outside
+  // (0, 256] or a glow threshold outside [0, 256]
+  bool parse(const std::string& text);
+
+  // number of stages
+  int size() const;
+
+  // name of every stage, in order (e.g. "grayscale", "glow(200,1)")
+  std::vector<std::string> names() const;
+
+  // total halo of all stages: how far any input change can reach (capped
+  // far past any image side, so it can't overflow)
+  int halo() const;
+
+  // run every stage over the whole image
+  Image run(const Image& input) const;
+
+  // run every stage, or reuse a result for the same input pixels and the
+  // same stages from the given cache (and store new results there)
+  Image run(const Image& input, ResultCache& cache) const;
+
+  // cache key of running this pipeline on the given input: a hash of the
+  // input pixels combined with the stage names and parameters
+  uint64_t key(const Image& input) const;
+
+  // Bring output (a previous result of run or update for this input) up to
+  // date with the changes recorded in input.dirtyRegions(), recomputing
+  // only the affected areas, then clear the input's dirty regions. Falls
+  // back to a full run if output does not match the input size, or if the
+  // affected areas with their context cover more than half of the image
+  void update(Image& input, Image& output) const;
+
+ private:
+  struct Stage {
+    std::string name;
+    std::function<Image(const Image&)> op;
+    int halo;
+  };
+  std::vector<Stage> _stages;
+};
+
+}  // namespace agl
+#endif  // AGL_PIPELINE_H_
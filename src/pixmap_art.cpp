@@ -6,6 +6,9 @@
 
 #include <iostream>
 #include "image.h"
+#include "kernels.h"
+#include "pipeline.h"
+#include "result_cache.h"
 using namespace std;
 using namespace agl;
 
@@ -44,18 +47,36 @@ int main(int argc, char** argv) {
   waveAndTree = wave.difference(trees);
   waveAndTree.save("wave-minus-trees-abs.png");
 
+  // the same sum and product on linear light
+  waveAndTree = wave.add(trees, true);
+  waveAndTree.save("wave-plus-trees-linear.png");
+
+  waveAndTree = wave.multiply(trees, true);
+  waveAndTree.save("wave-times-trees-linear.png");
+
   waveAndTree = wave.lightest(trees);
   waveAndTree.save("wave-trees-max.png");
 
   waveAndTree = wave.darkest(trees);
   waveAndTree.save("wave-trees-min.png");
 
+  // combine several frames at once instead of chaining add/lightest/...
+  std::vector<const Image*> stack = {&wave, &trees};
+  Image stacked = stackReduce(stack, REDUCE_MEAN);
+  stacked.save("wave-trees-mean.png");
+
+  stacked = stackReduce(stack, REDUCE_WEIGHTED_MEAN, {0.25f, 0.75f});
+  stacked.save("wave-trees-weighted.png");
+
   Image flip = earth.flipVertical();
   flip.save("earth-flip-vertical.png");
 
   Image rotated = budapest1.rotate90();
   rotated.save("budapest1-rotated.png");
 
+  rotated = budapest1.rotate(12.5f);
+  rotated.save("budapest1-rotated-12.5.png");
+
   Image invert = budapest1.invert();
   invert.save("budapest1-invert.png");
 
@@ -65,14 +86,48 @@ int main(int argc, char** argv) {
   Image blur = earth.blur();
   blur.save("earth-blur.png");
 
+  blur = earth.gaussianBlur(8.0f);
+  blur.save("earth-gaussian-8.png");
+
   Image glow = earth.glow(200);
   glow.save("earth-glow.png");
 
+  glow = earth.glow(200, 12);
+  glow.save("earth-glow-12.png");
+
+  Image median = budapest2.median(3);
+  median.save("budapest2-median-3.png");
+
+  // clean up a thresholded mask: drop specks, then fill small holes
+  Image mask = earth.extractWhite(200).open(1).close(4);
+  mask.save("earth-white-mask.png");
+
   Image sobel = budapest1.sobelEdge();
   sobel.save("budapest1-sobel.png");
 
-  invert = budapest1.grayscale().sobelEdge().invert();
+  // the same chain through a result cache: the second run is a lookup
+  Pipeline edges;
+  edges.grayscale().sobelEdge().invert();
+  ResultCache cache;
+  invert = edges.run(budapest1, cache);
+  invert = edges.run(budapest1, cache);
   invert.save("budapest1-gray-sobel-invert.png");
+  cache.printStats(cout);
+
+  // same chain as a recorded pipeline: after pasting a patch, only the
+  // area around the patch is recomputed
+  Image source = budapest1;
+  Image edgeArt = edges.run(source);
+  source.replace(earth.subimage(100, 100, 120, 120), 270, 400);
+  edges.update(source, edgeArt);
+  edgeArt.save("budapest1-gray-sobel-invert-patched.png");
+
+  // fixed 3x3 kernels, specialized at compile time (kernels.h)
+  Image sharpen = filter<SharpenKernel>(temple);
+  sharpen.save("temple-sharpen.png");
+  Image emboss = filter<Kernel3x3<-2, -1, 0, -1, 0, 1, 0, 1, 2, 1, 128>>(
+      temple.grayscale());
+  emboss.save("temple-emboss.png");
 
   sobel = temple.sobelEdge();
   sobel.save("temple-sobel.png");
@@ -94,11 +149,28 @@ int main(int argc, char** argv) {
   Image bitmap = budapest2.bitMap();
   bitmap.save("budapest2-bitmap.png");
 
+  // 16 color palette, saved as an 8-bit indexed png
+  Image quantized = budapest2.quantize(16, DITHER_FLOYD_STEINBERG);
+  quantized.save("budapest2-quantize-16.png");
+
+  Image mosaic = budapest2.pixelate(24, 16);
+  mosaic.save("budapest2-pixelate.png");
+
+  // redact one region in place, reusing a single summed-area table
+  SummedAreaTable table = budapest1.summedAreaTable();
+  Image redacted = budapest1;
+  redacted.pixelate(table, 250, 300, 180, 140, 12, 12);
+  redacted.save("budapest1-redacted.png");
+
   Image templeSubimage = temple.subimage(200, 125, 400, 250);
   Image treesSubimage = trees.subimage(300, 150, 400, 250);
   Image blend = templeSubimage.alphaBlend(treesSubimage, 0.35f);
+  Image linearBlend = templeSubimage.alphaBlend(treesSubimage, 0.35f, true);
   trees.replace(blend, 300, 150);
   trees.save("trees-temple-blend.png");
+
+  trees.replace(linearBlend, 300, 150);
+  trees.save("trees-temple-blend-linear.png");
   
   return 0;
 }
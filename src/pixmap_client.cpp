@@ -0,0 +1,291 @@
+/* pixmap_client.cpp
+ * Implementation of PixmapClient and the socket/memfd message helpers
+ */
+
+#include "pixmap_client.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace agl {
+
+// longest message text accepted, to reject garbage lengths
+static const uint32_t kMaxMessage = 1 << 16;
+
+// largest image accepted through a descriptor (1 GiB of RGB)
+static const int64_t kMaxImageBytes = (int64_t) 1 << 30;
+
+// write all of data, retrying short writes; attach fd to the first part
+static bool sendAll(int socket, const char* data, size_t length, int fd) {
+  while (length > 0) {
+    struct iovec part = {(void*) data, length};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+      memset(control, 0, sizeof(control));
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+      struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+      header->cmsg_level = SOL_SOCKET;
+      header->cmsg_type = SCM_RIGHTS;
+      header->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+    ssize_t sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      return false;
+    }
+    data += sent;
+    length -= sent;
+    fd = -1;  // already delivered
+  }
+  return true;
+}
+
+// read exactly length bytes; any descriptor that arrives is stored in fd
+static bool receiveAll(int socket, char* data, size_t length, int& fd) {
+  while (length > 0) {
+    struct iovec part = {data, length};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    if (received <= 0) {
+      return false;
+    }
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL;
+        header = CMSG_NXTHDR(&message, header)) {
+      if (header->cmsg_level == SOL_SOCKET &&
+          header->cmsg_type == SCM_RIGHTS) {
+        int passed;
+        memcpy(&passed, CMSG_DATA(header), sizeof(int));
+        if (fd >= 0) {
+          ::close(fd);  // only one descriptor per message
+        }
+        fd = passed;
+      }
+    }
+    data += received;
+    length -= received;
+  }
+  return true;
+}
+
+bool sendMessage(int socket, const std::string& text, int fd) {
+  std::string message(4, '\0');
+  uint32_t length = (uint32_t) text.size();
+  memcpy(&message[0], &length, 4);
+  message += text;
+  return sendAll(socket, message.data(), message.size(), fd);
+}
+
+bool receiveMessage(int socket, std::string& text, int& fd) {
+  fd = -1;
+  uint32_t length;
+  bool ok = receiveAll(socket, (char*) &length, 4, fd) &&
+      length <= kMaxMessage;
+  if (ok) {
+    text.assign(length, '\0');
+    ok = length == 0 || receiveAll(socket, &text[0], length, fd);
+  }
+  if (!ok && fd >= 0) {
+    ::close(fd);  // arrived with a message that was cut short
+    fd = -1;
+  }
+  return ok;
+}
+
+int imageToMemfd(const Image& image) {
+  size_t bytes = sizeof(struct Pixel) * image.width() * image.height();
+  int fd = memfd_create("pixmap", MFD_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, bytes) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  if (bytes > 0) {
+    void* mapped = mmap(NULL, bytes, PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+      ::close(fd);
+      return -1;
+    }
+    memcpy(mapped, image.data(), bytes);
+    munmap(mapped, bytes);
+  }
+  return fd;
+}
+
+bool imageFromFd(int fd, int width, int height, Image& image) {
+  // reject sizes whose pixel count would overflow Image's int arithmetic
+  // (and absurd allocations) before trusting them
+  int64_t bytes64 = (int64_t) width * height * sizeof(struct Pixel);
+  if (width <= 0 || height <= 0 || bytes64 > kMaxImageBytes) {
+    return false;
+  }
+  size_t bytes = (size_t) bytes64;
+  struct stat info;
+  // mapping past the end of the file would fault on access
+  if (fstat(fd, &info) != 0 || (size_t) info.st_size < bytes) {
+    return false;
+  }
+  void* mapped = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  Image result(width, height);
+  memcpy(result.data(), mapped, bytes);
+  munmap(mapped, bytes);
+  image = result;
+  return true;
+}
+
+PixmapClient::PixmapClient() {  }
+
+PixmapClient::~PixmapClient() {
+  close();
+}
+
+bool PixmapClient::connect(const std::string& socketPath) {
+  close();
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    _error = "socket path too long";
+    return false;
+  }
+  strcpy(address.sun_path, socketPath.c_str());
+  _socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (_socket < 0 ||
+      ::connect(_socket, (struct sockaddr*) &address, sizeof(address)) != 0) {
+    _error = "cannot connect to " + socketPath + ": " + strerror(errno);
+    close();
+    return false;
+  }
+  return true;
+}
+
+void PixmapClient::close() {
+  if (_socket >= 0) {
+    ::close(_socket);
+    _socket = -1;
+  }
+}
+
+bool PixmapClient::isOpen() const {
+  return _socket >= 0;
+}
+
+bool PixmapClient::run(const std::string& input, const std::string& pipeline,
+    const std::string& output) {
+  std::string reply;
+  int replyFd;
+  bool ok = request("run file:" + input + " file:" + output + " " + pipeline,
+      -1, reply, replyFd);
+  if (replyFd >= 0) {
+    ::close(replyFd);  // no pixels expected back
+  }
+  return ok;
+}
+
+bool PixmapClient::run(const std::string& input, const std::string& pipeline,
+    Image& result) {
+  std::string reply;
+  int replyFd;
+  if (!request("run file:" + input + " memfd " + pipeline, -1, reply,
+      replyFd)) {
+    return false;
+  }
+  return receiveImage(reply, replyFd, result);
+}
+
+bool PixmapClient::run(const Image& input, const std::string& pipeline,
+    Image& result) {
+  int fd = imageToMemfd(input);
+  if (fd < 0) {
+    _error = std::string("cannot create memfd: ") + strerror(errno);
+    return false;
+  }
+  std::string reply;
+  int replyFd;
+  bool ok = request("run memfd:" + std::to_string(input.width()) + "x" +
+      std::to_string(input.height()) + " memfd " + pipeline, fd, reply,
+      replyFd);
+  ::close(fd);
+  return ok && receiveImage(reply, replyFd, result);
+}
+
+std::string PixmapClient::stats() {
+  std::string reply;
+  int replyFd;
+  bool ok = request("stats", -1, reply, replyFd);
+  if (replyFd >= 0) {
+    ::close(replyFd);  // no pixels expected back
+  }
+  if (!ok) {
+    return "";
+  }
+  return reply.substr(std::min<size_t>(3, reply.size()));
+}
+
+const std::string& PixmapClient::error() const {
+  return _error;
+}
+
+bool PixmapClient::request(const std::string& text, int fd,
+    std::string& reply, int& replyFd) {
+  replyFd = -1;
+  if (_socket < 0) {
+    _error = "not connected";
+    return false;
+  }
+  if (!sendMessage(_socket, text, fd) ||
+      !receiveMessage(_socket, reply, replyFd)) {
+    _error = "connection to server lost";
+    close();
+    return false;
+  }
+  if (reply.compare(0, 2, "ok") != 0) {
+    _error = reply.compare(0, 6, "error ") == 0 ? reply.substr(6) : reply;
+    if (replyFd >= 0) {
+      ::close(replyFd);
+      replyFd = -1;
+    }
+    return false;
+  }
+  return true;
+}
+
+bool PixmapClient::receiveImage(const std::string& reply, int replyFd,
+    Image& result) {
+  int width = 0, height = 0;
+  bool ok = replyFd >= 0 &&
+      sscanf(reply.c_str(), "ok %d %d", &width, &height) == 2 &&
+      imageFromFd(replyFd, width, height, result);
+  if (replyFd >= 0) {
+    ::close(replyFd);
+  }
+  if (!ok) {
+    _error = "bad reply from server: " + reply;
+  }
+  return ok;
+}
+
+}  // namespace agl
@@ -0,0 +1,98 @@
+/* pixmap_client.h
+ * Client for pixmap_server, plus the message helpers both sides use
+ *
+ * Protocol: every message is a 32-bit length followed by that many bytes
+ * of text, with at most one file descriptor attached (SCM_RIGHTS). A
+ * connection carries any number of requests, each answered in order:
+ *
+ *   run <source> <target> <pipeline>
+ *     source: file:<path>, an image file the server decodes and keeps
+ *             resident, or memfd:<width>x<height>, raw RGB pixels in the
+ *             attached descriptor
+ *     target: file:<path>, saved by the server, or memfd, raw RGB pixels
+ *             sent back in an attached descriptor
+ *     file paths are relative to the server's file root and may not
+ *     leave it (no absolute paths or "..")
+ *     pipeline: stages as accepted by Pipeline::parse, e.g.
+ *             grayscale|gaussianBlur(2)
+ *   stats
+ *
+ * Replies are "ok <width> <height>" (for run), "ok <text>" (for stats) or
+ * "error <message>". Paths cannot contain spaces. Linux only (memfd).
+ */
+
+#ifndef AGL_PIXMAP_CLIENT_H_
+#define AGL_PIXMAP_CLIENT_H_
+
+#include <string>
+#include "image.h"
+
+namespace agl {
+
+// send text with an optional descriptor (-1 for none); false on error
+bool sendMessage(int socket, const std::string& text, int fd = -1);
+
+// receive one message; fd is set to the attached descriptor or -1
+// false if the connection closed or failed (a descriptor received with
+// the broken message is closed, and fd is -1)
+bool receiveMessage(int socket, std::string& text, int& fd);
+
+// copy pixels into a new memfd; returns the descriptor or -1
+int imageToMemfd(const Image& image);
+
+// copy width x height raw RGB pixels from a descriptor into image; false if
+// the size is not positive, exceeds 1 GiB of pixels, or the descriptor
+// holds fewer bytes than that
+bool imageFromFd(int fd, int width, int height, Image& image);
+
+/**
+ * @brief Connection to a running pixmap_server
+ *
+ * Requests on one client run one at a time; use a client per thread for
+ * concurrent requests.
+ */
+class PixmapClient {
+ public:
+  PixmapClient();
+  ~PixmapClient();
+  PixmapClient(const PixmapClient&) = delete;
+  PixmapClient& operator=(const PixmapClient&) = delete;
+
+  // connect to the server listening on socketPath
+  bool connect(const std::string& socketPath);
+  void close();
+  bool isOpen() const;
+
+  // run pipeline on an image file (decoded once and kept by the server)
+  // and have the server save the result to an output file
+  bool run(const std::string& input, const std::string& pipeline,
+      const std::string& output);
+
+  // run pipeline on an image file and receive the result pixels
+  bool run(const std::string& input, const std::string& pipeline,
+      Image& result);
+
+  // send pixels, run pipeline on them and receive the result pixels
+  bool run(const Image& input, const std::string& pipeline, Image& result);
+
+  // server cache statistics, empty on error
+  std::string stats();
+
+  // reason the last call failed
+  const std::string& error() const;
+
+ private:
+  int _socket = -1;
+  std::string _error;
+
+  // send a request and wait for its reply; false on connection errors and
+  // "error" replies, with the message in _error
+  bool request(const std::string& text, int fd, std::string& reply,
+      int& replyFd);
+
+  // receive pixels for a reply of the form "ok <width> <height>"
+  bool receiveImage(const std::string& reply, int replyFd, Image& result);
+};
+
+}  // namespace agl
+#endif  // AGL_PIXMAP_CLIENT_H_
@@ -0,0 +1,51 @@
+/* pixmap_compare.cpp
+ * Compares an image against a reference render, for golden image checks:
+ *
+ *   pixmap_compare <expected> <actual> [tolerance] [minSsim]
+ *
+ * Passes (exit 0) if no channel differs by more than tolerance (default 0)
+ * or, when minSsim is given, if the SSIM is at least minSsim. Otherwise
+ * prints MSE, PSNR, max error and SSIM and exits with 1; exits with 2 if
+ * an image cannot be loaded or the sizes differ
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include "image.h"
+#include "metrics.h"
+using namespace std;
+using namespace agl;
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    cout << "usage: " << argv[0]
+        << " <expected> <actual> [tolerance] [minSsim]" << endl;
+    return 2;
+  }
+  int tolerance = argc > 3 ? atoi(argv[3]) : 0;
+  double minSsim = argc > 4 ? atof(argv[4]) : 2;  // > 1: never passes
+
+  Image expected, actual;
+  if (!expected.load(argv[1]) || !actual.load(argv[2])) {
+    cout << "ERROR: Cannot load " << argv[1] << " or " << argv[2] << endl;
+    return 2;
+  }
+  if (expected.width() != actual.width() ||
+      expected.height() != actual.height()) {
+    cout << "FAIL " << argv[2] << ": size " << actual.width() << " x "
+        << actual.height() << ", expected " << expected.width() << " x "
+        << expected.height() << endl;
+    return 2;
+  }
+
+  // the cheap check first; most runs stop here
+  if (equalWithin(expected, actual, tolerance)) {
+    return 0;
+  }
+  ImageDifference diff = compare(expected, actual);
+  bool pass = diff.ssim >= minSsim;
+  cout << (pass ? "PASS " : "FAIL ") << argv[2] << ": mse " << diff.mse
+      << ", psnr " << diff.psnr << " dB, max error " << diff.maxError
+      << ", ssim " << diff.ssim << endl;
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+/* pixmap_load.cpp
+ * Load test for pixmap_server: several connections send small requests
+ * over and over and report throughput and latency
+ *
+ *   pixmap_load <socket path> <image> [requests] [connections] [pipeline]
+ *       [fresh|cached]
+ *
+ * Defaults: 1000 requests over 4 connections running "grayscale", fresh.
+ * Results come back through memfd. In fresh mode every request sends
+ * pixels (the image, or a generated one for an image path of "-") through
+ * memfd with a request number stamped into the first pixels, so each one
+ * misses the server's result cache and the latency is that of running the
+ * pipeline. In cached mode every request is the same, so after the first
+ * one the latency is that of a cache hit; the server loads the file itself
+ * (a path under its file root) unless the path is "-"
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "image.h"
+#include "pixmap_client.h"
+using namespace std;
+using namespace agl;
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    cout << "usage: " << argv[0]
+        << " <socket path> <image> [requests] [connections] [pipeline]"
+        << " [fresh|cached]" << endl;
+    return 1;
+  }
+  string socketPath = argv[1];
+  string imagePath = argv[2];
+  int requests = argc > 3 ? atoi(argv[3]) : 1000;
+  int connections = max(1, argc > 4 ? atoi(argv[4]) : 4);
+  string pipeline = argc > 5 ? argv[5] : "grayscale";
+  string mode = argc > 6 ? argv[6] : "fresh";
+  if (mode != "fresh" && mode != "cached") {
+    cout << "ERROR: mode must be fresh or cached" << endl;
+    return 1;
+  }
+  bool fresh = mode == "fresh";
+
+  // send pixels instead of a path: always when fresh, and for "-", which
+  // uses a generated test image
+  bool sendPixels = fresh || imagePath == "-";
+  Image pixels(256, 256);
+  if (imagePath != "-" && fresh) {
+    if (!pixels.load(imagePath) || pixels.width() * pixels.height() < 2) {
+      cout << "ERROR: cannot load " << imagePath << endl;
+      return 1;
+    }
+  } else {
+    for (int i = 0; i < pixels.height(); i++) {
+      for (int j = 0; j < pixels.width(); j++) {
+        pixels.set(i, j, Pixel{(unsigned char) i, (unsigned char) j, 128});
+      }
+    }
+  }
+
+  vector<double> latencies;  // milliseconds
+  mutex mutex;
+  int failures = 0;
+  auto start = chrono::steady_clock::now();
+  vector<thread> workers;
+  for (int c = 0; c < connections; c++) {
+    int count = requests / connections + (c < requests % connections);
+    workers.emplace_back([&, c, count]() {
+      PixmapClient client;
+      Image input = pixels;  // stamped per request when fresh
+      vector<double> mine;
+      int failed = 0;
+      if (!client.connect(socketPath)) {
+        lock_guard<std::mutex> lock(mutex);
+        cout << "ERROR: " << client.error() << endl;
+        failures += count;
+        return;
+      }
+      for (int k = 0; k < count; k++) {
+        if (fresh) {
+          // a number unique to this request, in the first 4 bytes
+          uint32_t stamp = (uint32_t) c * (requests + 1) + k;
+          input.set(0, 0, Pixel{(unsigned char) stamp,
+              (unsigned char) (stamp >> 8), (unsigned char) (stamp >> 16)});
+          Pixel second = input.get(1);
+          second.r = (unsigned char) (stamp >> 24);
+          input.set(1, second);
+        }
+        auto before = chrono::steady_clock::now();
+        Image result;
+        bool ok = sendPixels ? client.run(input, pipeline, result) :
+            client.run(imagePath, pipeline, result);
+        auto after = chrono::steady_clock::now();
+        if (!ok) {
+          failed++;
+          if (!client.isOpen()) {
+            failed += count - k - 1;
+            break;
+          }
+          continue;
+        }
+        mine.push_back(
+            chrono::duration<double, milli>(after - before).count());
+      }
+      lock_guard<std::mutex> lock(mutex);
+      latencies.insert(latencies.end(), mine.begin(), mine.end());
+      failures += failed;
+      if (failed > 0) {
+        cout << "ERROR: " << client.error() << endl;
+      }
+    });
+  }
+  for (thread& worker : workers) {
+    worker.join();
+  }
+  double seconds = chrono::duration<double>(
+      chrono::steady_clock::now() - start).count();
+
+  sort(latencies.begin(), latencies.end());
+  size_t done = latencies.size();
+  cout << (fresh ? "fresh inputs: latency of running " :
+      "cached: latency of result cache hits for ") << pipeline << endl;
+  cout << done << " requests in " << seconds << " s ("
+      << done / seconds << " per second), " << failures << " failed" << endl;
+  if (done > 0) {
+    double total = 0;
+    for (double latency : latencies) {
+      total += latency;
+    }
+    cout << "latency ms: mean " << total / done
+        << ", p50 " << latencies[done / 2]
+        << ", p99 " << latencies[min(done - 1, done * 99 / 100)]
+        << ", max " << latencies.back() << endl;
+  }
+  PixmapClient client;
+  if (client.connect(socketPath)) {
+    cout << client.stats();
+  }
+  return failures > 0;
+}
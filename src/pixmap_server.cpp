@@ -0,0 +1,244 @@
+/* pixmap_server.cpp
+ * Long running image processing daemon: listens on a Unix domain socket
+ * and runs pipelines for clients (see pixmap_client.h for the protocol)
+ *
+ *   pixmap_server <socket path> [cache MB] [file root]
+ *
+ * file: sources and targets are paths relative to the file root (the
+ * working directory by default) and must stay inside it. Decoded input files and pipeline results stay in memory between
+ * requests (each tier gets half of the cache budget, 512 MB by default),
+ * as do the worker threads, so a request pays neither process startup nor
+ * decoding of a file that was seen before. Every connection is served by
+ * its own thread. Linux only
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "hash.h"
+#include "image.h"
+#include "pipeline.h"
+#include "pixmap_client.h"
+#include "result_cache.h"
+using namespace std;
+using namespace agl;
+
+static char socketPath[108];  // for removing the socket on exit
+
+static void stop(int) {
+  unlink(socketPath);
+  _exit(0);
+}
+
+class Server {
+ public:
+  // root must be a canonical path (see realpath)
+  Server(size_t cacheBytes, const string& root): _inputs(cacheBytes / 2),
+      _results(cacheBytes / 2), _root(root) {  }
+
+  // answer requests on one connection until the client hangs up
+  void serve(int client) {
+    string request;
+    int fd;
+    while (receiveMessage(client, request, fd)) {
+      int replyFd = -1;
+      string reply;
+      // a bad request must only fail itself, never the whole daemon
+      try {
+        reply = handle(request, fd, replyFd);
+      } catch (const exception& error) {
+        reply = string("error ") + error.what();
+        if (replyFd >= 0) {
+          close(replyFd);
+          replyFd = -1;
+        }
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+      bool sent = sendMessage(client, reply, replyFd);
+      if (replyFd >= 0) {
+        close(replyFd);
+      }
+      if (!sent) {
+        break;
+      }
+    }
+    close(client);
+  }
+
+ private:
+  ResultCache _inputs;   // decoded input files
+  ResultCache _results;  // pipeline outputs
+  string _root;  // directory file: paths are relative to
+
+  // Map a client path to a file under _root. Clients may not reach
+  // outside it: absolute paths and ".." are refused, and symbolic links
+  // are resolved (for a target, those of its directory) before checking
+  bool resolve(const string& path, bool existing, string& resolved) const {
+    if (path.empty() || path[0] == '/' || path.back() == '/') {
+      return false;
+    }
+    istringstream parts(path);
+    string part;
+    while (getline(parts, part, '/')) {
+      if (part == "..") {
+        return false;
+      }
+    }
+    string full = _root + "/" + path;
+    size_t slash = full.rfind('/');
+    string checked = existing ? full : full.substr(0, slash);
+    char real[PATH_MAX];
+    if (realpath(checked.c_str(), real) == NULL) {
+      return false;
+    }
+    string inside = real;
+    bool contained = _root == "/" || inside == _root ||
+        inside.compare(0, _root.size() + 1, _root + "/") == 0;
+    if (!contained) {
+      return false;
+    }
+    resolved = existing ? inside : inside + full.substr(slash);
+    return true;
+  }
+
+  string handle(const string& request, int fd, int& replyFd) {
+    istringstream words(request);
+    string command, source, target;
+    words >> command;
+    if (command == "stats") {
+      ostringstream stats;
+      stats << "ok inputs: ";
+      _inputs.printStats(stats);
+      stats << "results: ";
+      _results.printStats(stats);
+      return stats.str();
+    }
+    if (command != "run" || !(words >> source >> target)) {
+      return "error expected: run <source> <target> <pipeline>";
+    }
+    string stages;
+    getline(words, stages);
+    Pipeline pipeline;
+    if (!pipeline.parse(stages)) {
+      return "error bad pipeline:" + stages;
+    }
+
+    Image input;
+    if (source.compare(0, 5, "file:") == 0) {
+      string path;
+      if (!resolve(source.substr(5), true, path) || !loadInput(path, input)) {
+        return "error cannot load " + source.substr(5);
+      }
+    } else {
+      int width, height;
+      if (sscanf(source.c_str(), "memfd:%dx%d", &width, &height) != 2 ||
+          fd < 0 || !imageFromFd(fd, width, height, input)) {
+        return "error bad source " + source;
+      }
+    }
+
+    Image result = pipeline.run(input, _results);
+    if (target.compare(0, 5, "file:") == 0) {
+      string path;
+      if (!resolve(target.substr(5), false, path) || !result.save(path)) {
+        return "error cannot save " + target.substr(5);
+      }
+    } else if (target == "memfd") {
+      replyFd = imageToMemfd(result);
+      if (replyFd < 0) {
+        return "error cannot create memfd";
+      }
+    } else {
+      return "error bad target " + target;
+    }
+    return "ok " + to_string(result.width()) + " " +
+        to_string(result.height());
+  }
+
+  // decode a file, or reuse it if it did not change since the last time
+  bool loadInput(const string& path, Image& image) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+      return false;
+    }
+    uint64_t version = (uint64_t) info.st_mtim.tv_sec * 1000000000 +
+        info.st_mtim.tv_nsec;
+    uint64_t key = hash64(path.data(), path.size(),
+        version ^ (uint64_t) info.st_size);
+    if (_inputs.lookup(key, image)) {
+      return true;
+    }
+    if (!image.load(path)) {
+      return false;
+    }
+    _inputs.store(key, image);
+    return true;
+  }
+};
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    cout << "usage: " << argv[0] << " <socket path> [cache MB] [file root]"
+        << endl;
+    return 1;
+  }
+  size_t cacheBytes = (size_t) (argc > 2 ? atoi(argv[2]) : 512) << 20;
+  char root[PATH_MAX];
+  if (realpath(argc > 3 ? argv[3] : ".", root) == NULL) {
+    cout << "ERROR: bad file root: " << strerror(errno) << endl;
+    return 1;
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(argv[1]) >= sizeof(address.sun_path)) {
+    cout << "ERROR: socket path too long" << endl;
+    return 1;
+  }
+  strcpy(address.sun_path, argv[1]);
+  strcpy(socketPath, argv[1]);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(argv[1]);  // left behind by an earlier run
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+      listen(listener, 128) != 0) {
+    cout << "ERROR: cannot listen on " << argv[1] << ": " << strerror(errno)
+        << endl;
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  cout << "pixmap_server listening on " << argv[1] << ", files under "
+      << root << endl;
+
+  Server server(cacheBytes, root);
+  while (true) {
+    int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      cout << "ERROR: accept failed: " << strerror(errno) << endl;
+      break;
+    }
+    thread(&Server::serve, &server, client).detach();
+  }
+  unlink(argv[1]);
+  return 1;
+}
@@ -1,7 +1,16 @@
 // Copyright 2021, Aline Normoyle, alinen
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <string>
+#include <vector>
+#include "color.h"
 #include "image.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "tiled_image.h"
 using namespace std;
 using namespace agl;
 
@@ -13,8 +22,7 @@ int main(int argc, char** argv) {
   }
 
   for (int i = 0; i < image.height(); i++) {
-    for (int j = 0; j < image.width(); j++) {
-        Pixel c = image.get(i, j);
+    for (const Pixel& c : image.crow(i)) {
         std::cout << "(" << (int)c.r << "," << (int)c.g << "," << (int)c.b << ") ";
     }
     std::cout << std::endl;
@@ -54,6 +62,12 @@ int main(int argc, char** argv) {
   Image resize = image.resize(200,300);
   resize.save("earth-200-300.png");
 
+  // resize from a cached pyramid (e.g. several thumbnail sizes per image)
+  std::vector<Image> pyramid = image.buildPyramid(16);
+  cout << "earth pyramid levels: " << pyramid.size() << endl;  // 4
+  Image thumbnail = image.resize(64, 64, pyramid);
+  thumbnail.save("earth-thumbnail-64.png");
+
   // grayscale
   Image grayscale = image.grayscale();
   grayscale.save("earth-grayscale.png");
@@ -73,6 +87,205 @@ int main(int argc, char** argv) {
   gamma = image.gammaCorrect(2.2f);
   gamma.save("earth-gamma-2.2.png");
 
+  // comparison metrics: a copy is identical, a blur is close but not equal
+  Image blurred = image.blur();
+  cout << "copy equal: " << equalWithin(image, Image(image)) << endl;  // 1
+  ImageDifference diff = compare(image, blurred);
+  cout << "blur: psnr " << diff.psnr << " dB, max error " << diff.maxError
+      << ", ssim " << diff.ssim << endl;
+
+  // gaussian blur keeps a flat image flat, even at large sigma
+  Image flat(400, 400);
+  for (int i = 0; i < flat.width() * flat.height(); i++) {
+    flat.set(i, Pixel{200, 200, 200});
+  }
+  Image flatBlur = flat.gaussianBlur(100);
+  cout << "flat gaussian(100) equal: " << equalWithin(flat, flatBlur)
+      << endl;  // 1
+
+  // incremental update of a chain with an infinite (recursive) footprint
+  Pipeline soften;
+  soften.gaussianBlur(3).invert();
+  Image patched = image;
+  Image softened = soften.run(patched);
+  patched.clearDirty();
+  patched.replace(image.subimage(0, 0, 50, 40), 150, 220);
+  soften.update(patched, softened);
+  cout << "gaussian update equal: "
+      << equalWithin(softened, soften.run(patched)) << endl;  // 1
+
+  // small random image for checks against brute force
+  Image noise(20, 20);
+  srand(7);
+  for (int i = 0; i < noise.width() * noise.height(); i++) {
+    noise.set(i, Pixel{(unsigned char) (rand() % 256),
+        (unsigned char) (rand() % 256), (unsigned char) (rand() % 256)});
+  }
+
+  // dilate and erode: max and min over the window, clipped to the image
+  bool morphologyExact = true;
+  for (int rx : {1, 3, 12}) {
+    int ry = rx == 3 ? 5 : rx;
+    int bottom = noise.height() - 1, right = noise.width() - 1;
+    Image dilated = noise.dilate(rx, ry);
+    Image eroded = noise.erode(rx, ry);
+    for (int i = 0; i < noise.height(); i++) {
+      for (int j = 0; j < noise.width(); j++) {
+        Pixel most = noise.get(i, j), least = most;
+        for (int y = max(i - ry, 0); y <= min(i + ry, bottom); y++) {
+          for (int x = max(j - rx, 0); x <= min(j + rx, right); x++) {
+            Pixel c = noise.get(y, x);
+            most = Pixel{max(most.r, c.r), max(most.g, c.g), max(most.b, c.b)};
+            least = Pixel{min(least.r, c.r), min(least.g, c.g),
+                min(least.b, c.b)};
+          }
+        }
+        Pixel d = dilated.get(i, j), e = eroded.get(i, j);
+        morphologyExact = morphologyExact && d.r == most.r && d.g == most.g &&
+            d.b == most.b && e.r == least.r && e.g == least.g &&
+            e.b == least.b;
+      }
+    }
+  }
+  cout << "dilate/erode exact: " << morphologyExact << endl;  // 1
+
+  // median: middle of each channel over the window, edges replicated
+  bool medianExact = true;
+  for (int radius : {1, 2, 9}) {
+    Image filtered = noise.median(radius);
+    int bottom = noise.height() - 1, right = noise.width() - 1;
+    for (int i = 0; i < noise.height(); i++) {
+      for (int j = 0; j < noise.width(); j++) {
+        std::vector<unsigned char> r, g, b;
+        for (int y = i - radius; y <= i + radius; y++) {
+          for (int x = j - radius; x <= j + radius; x++) {
+            Pixel c = noise.get(min(max(y, 0), bottom), min(max(x, 0), right));
+            r.push_back(c.r);
+            g.push_back(c.g);
+            b.push_back(c.b);
+          }
+        }
+        size_t middle = r.size() / 2;
+        std::nth_element(r.begin(), r.begin() + middle, r.end());
+        std::nth_element(g.begin(), g.begin() + middle, g.end());
+        std::nth_element(b.begin(), b.begin() + middle, b.end());
+        Pixel m = filtered.get(i, j);
+        medianExact = medianExact && m.r == r[middle] && m.g == g[middle] &&
+            m.b == b[middle];
+      }
+    }
+  }
+  cout << "median exact: " << medianExact << endl;  // 1
+
+  // stackReduce against each channel of a stack of three, one at a time
+  Image inverted = noise.invert();
+  Image mirrored = noise.flipHorizontal();
+  std::vector<const Image*> stack = {&noise, &inverted, &mirrored};
+  const Image stackMax = stackReduce(stack, REDUCE_MAX);
+  const Image stackMin = stackReduce(stack, REDUCE_MIN);
+  const Image stackMedian = stackReduce(stack, REDUCE_MEDIAN);
+  const Image stackMean = stackReduce(stack, REDUCE_MEAN);
+  const Image stackSum = stackReduce(stack, REDUCE_SUM);
+  bool stackExact = equalWithin(inverted,
+      stackReduce(stack, REDUCE_WEIGHTED_MEAN, {0, 1, 0}));
+  for (int b = 0; b < noise.width() * noise.height() * 3; b++) {
+    int v[3];
+    for (int k = 0; k < 3; k++) {
+      v[k] = (unsigned char) stack[k]->data()[b];
+    }
+    std::sort(v, v + 3);
+    int sum = v[0] + v[1] + v[2];
+    stackExact = stackExact &&
+        (unsigned char) stackMax.data()[b] == v[2] &&
+        (unsigned char) stackMin.data()[b] == v[0] &&
+        (unsigned char) stackMedian.data()[b] == v[1] &&
+        (unsigned char) stackMean.data()[b] == (sum + 1) / 3 &&
+        (unsigned char) stackSum.data()[b] == min(sum, 255);
+  }
+  cout << "stack reduce exact: " << stackExact << endl;  // 1
+
+  // color conversions round-trip; YCbCr is stored in 8 bits, so it may be
+  // off by one
+  bool srgbExact = true;
+  for (int v = 0; v < 256; v++) {
+    srgbExact = srgbExact && linearToSrgb(srgbToLinear(v)) == v;
+  }
+  cout << "color round trips: " << (srgbExact &&
+      equalWithin(noise, linearToSrgb(srgbToLinear(noise))) &&
+      equalWithin(noise, hsvToRgb(rgbToHsv(noise))) &&
+      equalWithin(noise, labToRgb(rgbToLab(noise))) &&
+      equalWithin(noise, yCbCrToRgb(rgbToYCbCr(noise)), 1)) << endl;  // 1
+
+  // warpAffine: the identity, and a whole-pixel shift, copy pixels exactly
+  const float identity[6] = {1, 0, 0, 0, 1, 0};
+  const float shift[6] = {1, 0, 5, 0, 1, 3};
+  cout << "identity warp equal: "
+      << (equalWithin(noise, noise.warpAffine(identity, 20, 20, NEAREST)) &&
+          equalWithin(noise, noise.warpAffine(identity, 20, 20, BILINEAR)))
+      << endl;  // 1
+  cout << "shift warp equal: "
+      << equalWithin(noise.subimage(5, 3, 10, 10),
+          noise.warpAffine(shift, 10, 10, BILINEAR)) << endl;  // 1
+
+  // quantize: at most colors entries, and every pixel is one of them
+  bool paletteOk = true;
+  for (int colors : {2, 16, 256}) {
+    for (Dither dither : {DITHER_NONE, DITHER_FLOYD_STEINBERG}) {
+      Image reduced = noise.quantize(colors, dither);
+      const std::vector<Pixel>& palette = reduced.palette();
+      paletteOk = paletteOk && !palette.empty() &&
+          (int) palette.size() <= colors;
+      for (int i = 0; i < reduced.width() * reduced.height(); i++) {
+        Pixel c = reduced.get(i);
+        paletteOk = paletteOk && std::any_of(palette.begin(), palette.end(),
+            [&](const Pixel& p) {
+              return p.r == c.r && p.g == c.g && p.b == c.b;
+            });
+      }
+    }
+  }
+  cout << "quantize palette ok: " << paletteOk << endl;  // 1
+
+  // ...and an image with fewer colors than the palette keeps them all
+  Image fewColors = noise.quantize(4);
+  cout << "quantize exact: "
+      << equalWithin(fewColors, fewColors.quantize(16)) << endl;  // 1
+
+  // pipeline text: stage names parse back to the same pipeline, and
+  // arguments out of range (which could come from a client) are refused
+  Pipeline parsed;
+  bool parseOk = parsed.parse(
+      "grayscale|blur|glow(200,3)|gaussianBlur(1.5)|median(2)|dilate(1)|"
+      "erode(4)|sobelEdge|invert");
+  std::string joined;
+  for (const std::string& name : parsed.names()) {
+    joined += name + "|";
+  }
+  Pipeline reparsed;
+  parseOk = parseOk && reparsed.parse(joined) &&
+      reparsed.names() == parsed.names() && parsed.size() == 9;
+  for (const char* bad : {"median(5000)", "gaussianBlur(nan)",
+      "gaussianBlur(0)", "dilate(-1)", "glow(300)", "glow(1,1e9)",
+      "erode(inf)", "blur(1)", "median(", "sharpen"}) {
+    Pipeline rejected;
+    parseOk = parseOk && !rejected.parse(bad);
+  }
+  cout << "pipeline parse ok: " << parseOk << endl;  // 1
+
+  // tiled canvas: paste, blur one region, read it back
+  {
+    TiledImage canvas(20000, 20000, "canvas-test.tiles", 16 << 20);
+    canvas.replace(image, 10000, 10000);
+    canvas.apply(10100, 10100, 200, 200,
+        [](const Image& tile) { return tile.blur(); }, 1);
+    canvas.subimage(10000, 10000, 400, 400).save("earth-tiled-blur.png");
+    cout << "tile cache: " << canvas.cacheHits() << " hits, "
+        << canvas.cacheMisses() << " misses" << endl;
+    cout << "tile file ok: " << !canvas.failed() << endl;  // 1
+  }
+  // the canvas has written back its tiles; its backing file isn't needed
+  std::remove("canvas-test.tiles");
+
   // alpha blend
   Image soup;
   soup.load("../images/soup.png");
@@ -0,0 +1,191 @@
+/* result_cache.cpp
+ * Implementation of ResultCache: an LRU memory tier over raw image files
+ */
+
+#include "result_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+namespace agl {
+
+static const char kMagic[4] = {'P', 'X', 'R', 'W'};
+static const int64_t kMaxImageBytes = (int64_t) 1 << 30;  // as in imageFromFd
+
+ResultCache::ResultCache(size_t memoryBytes, const std::string& directory):
+    _budget(memoryBytes), _directory(directory) {  }
+
+bool ResultCache::lookup(uint64_t key, Image& result) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  auto found = _entries.find(key);
+  if (found != _entries.end()) {
+    _memoryHits++;
+    _lru.splice(_lru.begin(), _lru, found->second.age);
+    result = found->second.image;
+    return true;
+  }
+  if (_directory.empty()) {
+    _misses++;
+    return false;
+  }
+  // read the file without holding the lock, other threads keep going
+  lock.unlock();
+  Image image;
+  bool onDisk = readFile(key, image);
+  lock.lock();
+  if (!onDisk) {
+    _misses++;
+    return false;
+  }
+  _diskHits++;
+  remember(key, image);
+  result = image;
+  return true;
+}
+
+void ResultCache::store(uint64_t key, const Image& result) {
+  if (!_directory.empty()) {
+    writeFile(key, result);
+  }
+  std::lock_guard<std::mutex> lock(_mutex);
+  remember(key, result);
+}
+
+void ResultCache::clear() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _entries.clear();
+  _lru.clear();
+  _used = 0;
+}
+
+uint64_t ResultCache::memoryHits() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _memoryHits;
+}
+
+uint64_t ResultCache::diskHits() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _diskHits;
+}
+
+uint64_t ResultCache::misses() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _misses;
+}
+
+void ResultCache::printStats(std::ostream& out) const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  uint64_t lookups = _memoryHits + _diskHits + _misses;
+  out << "result cache: " << lookups << " lookups, " << _memoryHits
+      << " memory hits, " << _diskHits << " disk hits, " << _misses
+      << " misses; " << _entries.size() << " results (" << (_used >> 10)
+      << " KiB) in memory" << std::endl;
+}
+
+void ResultCache::remember(uint64_t key, const Image& image) {
+  size_t bytes = sizeof(struct Pixel) * image.width() * image.height();
+  if (bytes > _budget) {
+    return;  // would evict everything else and still not fit
+  }
+  auto found = _entries.find(key);
+  if (found != _entries.end()) {
+    _used -= sizeof(struct Pixel) * found->second.image.width() *
+        found->second.image.height();
+    _lru.erase(found->second.age);
+    _entries.erase(found);
+  }
+  while (_used + bytes > _budget && !_lru.empty()) {
+    uint64_t oldest = _lru.back();
+    const Image& victim = _entries[oldest].image;
+    _used -= sizeof(struct Pixel) * victim.width() * victim.height();
+    _entries.erase(oldest);
+    _lru.pop_back();
+  }
+  _lru.push_front(key);
+  Entry& entry = _entries[key];
+  entry.image = image;
+  entry.age = _lru.begin();
+  _used += bytes;
+}
+
+std::string ResultCache::pathFor(uint64_t key) const {
+  std::ostringstream path;
+  path << _directory << "/" << std::hex << std::setw(16) << std::setfill('0')
+      << key << ".raw";
+  return path.str();
+}
+
+static void putLittleEndian(unsigned char* out, uint32_t value) {
+  out[0] = (unsigned char) value;
+  out[1] = (unsigned char) (value >> 8);
+  out[2] = (unsigned char) (value >> 16);
+  out[3] = (unsigned char) (value >> 24);
+}
+
+static uint32_t getLittleEndian(const unsigned char* in) {
+  return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t) in[3] << 24);
+}
+
+bool ResultCache::readFile(uint64_t key, Image& result) const {
+  std::ifstream file(pathFor(key).c_str(), std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  unsigned char header[16];
+  if (!file.read((char*) header, 16) || memcmp(header, kMagic, 4) != 0) {
+    return false;
+  }
+  // a corrupt or truncated file is a miss, never a huge allocation or a
+  // read past the pixels
+  int width = (int) getLittleEndian(header + 4);
+  int height = (int) getLittleEndian(header + 8);
+  int64_t bytes = (int64_t) width * height * sizeof(struct Pixel);
+  if (width <= 0 || height <= 0 || bytes > kMaxImageBytes) {
+    return false;
+  }
+  file.seekg(0, std::ios::end);
+  if (!file || (int64_t) file.tellg() != 16 + bytes) {
+    return false;
+  }
+  file.seekg(16);
+  Image image(width, height);
+  if (!file.read(image.data(), bytes)) {
+    return false;
+  }
+  result = image;
+  return true;
+}
+
+void ResultCache::writeFile(uint64_t key, const Image& image) const {
+  // write under a temporary name and rename, so readers never see a
+  // partially written file
+  std::string path = pathFor(key);
+  std::ostringstream temporary;
+  temporary << path << "." << std::this_thread::get_id() << ".tmp";
+  {
+    std::ofstream file(temporary.str().c_str(), std::ios::binary);
+    if (!file) {
+      return;
+    }
+    unsigned char header[16] = {0};
+    memcpy(header, kMagic, 4);
+    putLittleEndian(header + 4, (uint32_t) image.width());
+    putLittleEndian(header + 8, (uint32_t) image.height());
+    file.write((const char*) header, 16);
+    file.write(image.data(), sizeof(struct Pixel) * image.width() *
+        image.height());
+    if (!file) {
+      file.close();
+      std::remove(temporary.str().c_str());
+      return;
+    }
+  }
+  std::remove(path.c_str());  // rename does not replace files on Windows
+  std::rename(temporary.str().c_str(), path.c_str());
+}
+
+}  // namespace agl
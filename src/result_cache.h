@@ -0,0 +1,77 @@
+/* result_cache.h
+ * Content addressed cache of operator results, keyed by a hash of the input
+ * pixels and the operator chain, with an in-memory and an on-disk tier
+ */
+
+#ifndef AGL_RESULT_CACHE_H_
+#define AGL_RESULT_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "image.h"
+
+namespace agl {
+
+/**
+ * @brief Caches images by a 64-bit key (see Pipeline::run)
+ *
+ * Results are kept in memory up to a byte budget, dropping the least
+ * recently used ones. If a directory is given, every result is also
+ * written there as <key>.raw: a 16 byte header ("PXRW", width, height,
+ * reserved; little endian 32-bit) followed by the raw RGB pixels, so files
+ * can be mapped straight into memory. Results found on disk are promoted
+ * to the memory tier. Safe to share between threads.
+ */
+class ResultCache {
+ public:
+  // memoryBytes is the budget of the memory tier; an empty directory
+  // disables the disk tier (the directory must already exist)
+  explicit ResultCache(size_t memoryBytes = 256 << 20,
+      const std::string& directory = "");
+
+  // copy the result stored under key into result; false on a miss
+  bool lookup(uint64_t key, Image& result);
+
+  // store result under key in both tiers
+  void store(uint64_t key, const Image& result);
+
+  // drop every result from memory (files on disk are kept)
+  void clear();
+
+  // number of lookups served from memory, served from disk, and missed
+  uint64_t memoryHits() const;
+  uint64_t diskHits() const;
+  uint64_t misses() const;
+
+  // print hit/miss counts and memory use
+  void printStats(std::ostream& out) const;
+
+ private:
+  struct Entry {
+    Image image;
+    std::list<uint64_t>::iterator age;  // position in _lru
+  };
+
+  size_t _budget;
+  size_t _used = 0;  // bytes of pixels in the memory tier
+  std::string _directory;
+  std::unordered_map<uint64_t, Entry> _entries;
+  std::list<uint64_t> _lru;  // keys, most recently used first
+  uint64_t _memoryHits = 0;
+  uint64_t _diskHits = 0;
+  uint64_t _misses = 0;
+  mutable std::mutex _mutex;
+
+  // add to the memory tier, evicting old entries to stay in budget
+  void remember(uint64_t key, const Image& image);
+
+  std::string pathFor(uint64_t key) const;
+  bool readFile(uint64_t key, Image& result) const;
+  void writeFile(uint64_t key, const Image& image) const;
+};
+
+}  // namespace agl
+#endif  // AGL_RESULT_CACHE_H_
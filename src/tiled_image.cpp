@@ -0,0 +1,271 @@
+/* tiled_image.cpp
+ * Implementation of TiledImage: tiles live in slots of a backing file and
+ * are paged through an LRU cache with a fixed memory budget
+ */
+
+#include "tiled_image.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace agl {
+
+TiledImage::TiledImage(int width, int height, const std::string& path,
+    size_t cacheBytes, int tileSize): _width(width), _height(height),
+    _tileSize(std::max(tileSize, 1)) {
+  _tilesX = (_width + _tileSize - 1) / _tileSize;
+  _tilesY = (_height + _tileSize - 1) / _tileSize;
+  size_t tileBytes = sizeof(struct Pixel) * _tileSize * _tileSize;
+  // a few tiles at least, so a copy across a tile corner doesn't thrash
+  _maxTiles = std::max<size_t>(cacheBytes / tileBytes, 4);
+  _slots.assign((size_t) _tilesX * _tilesY, -1);
+  _file.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary |
+      std::ios::trunc);
+  if (!_file.is_open()) {
+    std::cout << "Cannot create tile file: " << path << std::endl;
+  }
+}
+
+TiledImage::~TiledImage() {
+  flush();
+}
+
+bool TiledImage::isOpen() const {
+  return _file.is_open();
+}
+
+int TiledImage::width() const {
+  return _width;
+}
+
+int TiledImage::height() const {
+  return _height;
+}
+
+int TiledImage::tileSize() const {
+  return _tileSize;
+}
+
+uint64_t TiledImage::cacheHits() const {
+  return _hits;
+}
+
+uint64_t TiledImage::cacheMisses() const {
+  return _misses;
+}
+
+bool TiledImage::failed() const {
+  return _failed;
+}
+
+void TiledImage::reportFailure(const std::string& what) {
+  if (!_failed) {
+    std::cout << "Tile file error: cannot " << what << std::endl;
+  }
+  _failed = true;
+  _file.clear();
+}
+
+void TiledImage::writeBack(int index, Tile& tile) {
+  if (_slots[index] < 0) {
+    _slots[index] = _nextSlot++;  // slots are handed out on first write
+  }
+  std::streamoff tileBytes = sizeof(struct Pixel) * _tileSize * _tileSize;
+  _file.seekp(_slots[index] * tileBytes);
+  _file.write((const char*) tile.pixels.data(), tileBytes);
+  if (!_file) {
+    reportFailure("write tile " + std::to_string(index));
+    return;  // still dirty, so a later flush tries again
+  }
+  tile.dirty = false;
+}
+
+TiledImage::Tile& TiledImage::load(int index) {
+  while (_cache.size() >= _maxTiles) {
+    int oldest = _lru.back();
+    Tile& victim = _cache[oldest];
+    if (victim.dirty) {
+      writeBack(oldest, victim);
+    }
+    if (oldest == _lastIndex) {
+      _lastIndex = -1;
+      _lastTile = NULL;
+    }
+    _lru.pop_back();
+    _cache.erase(oldest);
+  }
+  Tile& tile = _cache[index];
+  tile.pixels.resize(_tileSize * _tileSize);
+  if (_slots[index] >= 0) {
+    std::streamoff tileBytes = sizeof(struct Pixel) * _tileSize * _tileSize;
+    _file.seekg(_slots[index] * tileBytes);
+    _file.read((char*) tile.pixels.data(), tileBytes);
+    if (!_file) {
+      // a short or failed read: black rather than a partial tile
+      reportFailure("read tile " + std::to_string(index));
+      memset(tile.pixels.data(), 0,
+          sizeof(struct Pixel) * tile.pixels.size());
+    }
+  } else {
+    // never written, so never stored: black
+    memset(tile.pixels.data(), 0, sizeof(struct Pixel) * tile.pixels.size());
+  }
+  _lru.push_front(index);
+  tile.age = _lru.begin();
+  return tile;
+}
+
+TiledImage::Tile& TiledImage::fetch(int index) {
+  if (index == _lastIndex) {
+    _hits++;
+    return *_lastTile;
+  }
+  Tile* tile;
+  auto found = _cache.find(index);
+  if (found != _cache.end()) {
+    _hits++;
+    tile = &found->second;
+    _lru.splice(_lru.begin(), _lru, tile->age);
+  } else {
+    _misses++;
+    tile = &load(index);
+  }
+  _lastIndex = index;
+  _lastTile = tile;
+  return *tile;
+}
+
+Pixel TiledImage::get(int row, int col) {
+  Tile& tile = fetch((row / _tileSize) * _tilesX + col / _tileSize);
+  return tile.pixels[(row % _tileSize) * _tileSize + col % _tileSize];
+}
+
+void TiledImage::set(int row, int col, const Pixel& color) {
+  Tile& tile = fetch((row / _tileSize) * _tilesX + col / _tileSize);
+  tile.pixels[(row % _tileSize) * _tileSize + col % _tileSize] = color;
+  tile.dirty = true;
+}
+
+void TiledImage::copyOut(int x, int y, int w, int h, Pixel* dst,
+    int dstStride) {
+  for (int ty = y / _tileSize; ty <= (y + h - 1) / _tileSize; ty++) {
+    for (int tx = x / _tileSize; tx <= (x + w - 1) / _tileSize; tx++) {
+      Tile& tile = fetch(ty * _tilesX + tx);
+      // part of the requested rectangle inside this tile
+      int startx = std::max(x, tx * _tileSize);
+      int starty = std::max(y, ty * _tileSize);
+      int endx = std::min(x + w, (tx + 1) * _tileSize);
+      int endy = std::min(y + h, (ty + 1) * _tileSize);
+      for (int i = starty; i < endy; i++) {
+        memcpy(dst + (i - y) * dstStride + (startx - x),
+            tile.pixels.data() + (i - ty * _tileSize) * _tileSize +
+            (startx - tx * _tileSize), sizeof(struct Pixel) * (endx - startx));
+      }
+    }
+  }
+}
+
+void TiledImage::copyIn(int x, int y, int w, int h, const Pixel* src,
+    int srcStride) {
+  for (int ty = y / _tileSize; ty <= (y + h - 1) / _tileSize; ty++) {
+    for (int tx = x / _tileSize; tx <= (x + w - 1) / _tileSize; tx++) {
+      Tile& tile = fetch(ty * _tilesX + tx);
+      int startx = std::max(x, tx * _tileSize);
+      int starty = std::max(y, ty * _tileSize);
+      int endx = std::min(x + w, (tx + 1) * _tileSize);
+      int endy = std::min(y + h, (ty + 1) * _tileSize);
+      for (int i = starty; i < endy; i++) {
+        memcpy(tile.pixels.data() + (i - ty * _tileSize) * _tileSize +
+            (startx - tx * _tileSize), src + (i - y) * srcStride +
+            (startx - x), sizeof(struct Pixel) * (endx - startx));
+      }
+      tile.dirty = true;
+    }
+  }
+}
+
+Image TiledImage::subimage(int x, int y, int w, int h) {
+  Image sub(w, h);
+  // anything outside the canvas stays black
+  memset(sub.data(), 0, sizeof(struct Pixel) * w * h);
+  int startx = std::max(x, 0);
+  int starty = std::max(y, 0);
+  int endx = std::min(x + w, _width);
+  int endy = std::min(y + h, _height);
+  if (startx < endx && starty < endy) {
+    Pixel* dst = (Pixel*) sub.data();
+    copyOut(startx, starty, endx - startx, endy - starty,
+        dst + (starty - y) * w + (startx - x), w);
+  }
+  return sub;
+}
+
+void TiledImage::replace(const Image& image, int x, int y) {
+  // only replace as many pixels as will fit onto the canvas
+  int startx = std::max(x, 0);
+  int starty = std::max(y, 0);
+  int endx = std::min(x + image.width(), _width);
+  int endy = std::min(y + image.height(), _height);
+  if (startx < endx && starty < endy) {
+    const Pixel* src = (const Pixel*) image.data();
+    copyIn(startx, starty, endx - startx, endy - starty,
+        src + (starty - y) * image.width() + (startx - x), image.width());
+  }
+}
+
+void TiledImage::apply(int x, int y, int w, int h,
+    const std::function<Image(const Image&)>& op, int halo) {
+  halo = std::min(std::max(halo, 0), _tileSize);
+  int startx = std::max(x, 0);
+  int starty = std::max(y, 0);
+  int endx = std::min(x + w, _width);
+  int endy = std::min(y + h, _height);
+  if (startx >= endx || starty >= endy) {
+    return;
+  }
+  // A band's results are held back until the band below has been computed,
+  // so every tile reads unmodified input in its halo
+  struct Block {
+    int x, y;
+    Image pixels;
+  };
+  std::vector<Block> pending;
+  for (int ty = starty / _tileSize; ty <= (endy - 1) / _tileSize; ty++) {
+    std::vector<Block> band;
+    for (int tx = startx / _tileSize; tx <= (endx - 1) / _tileSize; tx++) {
+      int bx = std::max(startx, tx * _tileSize);
+      int by = std::max(starty, ty * _tileSize);
+      int bw = std::min(endx, (tx + 1) * _tileSize) - bx;
+      int bh = std::min(endy, (ty + 1) * _tileSize) - by;
+      // input grows by the halo, but never past the canvas edge so
+      // operators see the real border there
+      int sx = std::max(bx - halo, 0);
+      int sy = std::max(by - halo, 0);
+      int sw = std::min(bx + bw + halo, _width) - sx;
+      int sh = std::min(by + bh + halo, _height) - sy;
+      Image result = op(subimage(sx, sy, sw, sh));
+      band.push_back(Block{bx, by, result.subimage(bx - sx, by - sy, bw, bh)});
+    }
+    for (const Block& block : pending) {
+      replace(block.pixels, block.x, block.y);
+    }
+    pending.swap(band);
+  }
+  for (const Block& block : pending) {
+    replace(block.pixels, block.x, block.y);
+  }
+}
+
+void TiledImage::flush() {
+  for (auto& entry : _cache) {
+    if (entry.second.dirty) {
+      writeBack(entry.first, entry.second);
+    }
+  }
+  _file.flush();
+  if (!_file) {
+    reportFailure("flush");
+  }
+}
+
+}  // namespace agl
@@ -0,0 +1,135 @@
+/* tiled_image.h
+ * Out-of-core RGB canvas split into square tiles, kept in a backing file
+ * with an LRU cache of recently used tiles in memory
+ */
+
+#ifndef AGL_TILED_IMAGE_H_
+#define AGL_TILED_IMAGE_H_
+
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "image.h"
+
+namespace agl {
+
+/**
+ * @brief Implements a large canvas stored as tiles in a backing file
+ *
+ * Only tiles that have been written take space in the file; all others
+ * read as black. At most cacheBytes worth of tiles are kept in memory,
+ * dropping the least recently used ones (and writing them back if they
+ * changed). Tiles are read when first touched, on the calling thread.
+ */
+class TiledImage {
+ public:
+  // create a (width x height) black canvas backed by the file at path
+  // (created, or truncated if it exists)
+  TiledImage(int width, int height, const std::string& path,
+      size_t cacheBytes = 256 << 20, int tileSize = 256);
+  TiledImage(const TiledImage&) = delete;
+  TiledImage& operator=(const TiledImage&) = delete;
+
+  virtual ~TiledImage();  // writes back changed tiles
+
+  /** @brief Return whether the backing file could be created
+   */
+  bool isOpen() const;
+
+  /** @brief Return the canvas width in pixels
+   */
+  int width() const;
+
+  /** @brief Return the canvas height in pixels
+   */
+  int height() const;
+
+  /** @brief Return the width and height of one tile in pixels
+   */
+  int tileSize() const;
+
+  /**
+   * @brief Get the pixel at index (row, col)
+   *
+   * May load the tile holding the pixel, so it is not const
+   */
+  Pixel get(int row, int col);
+
+  /**
+   * @brief Set the pixel RGB color at index (row, col)
+   */
+  void set(int row, int col, const Pixel& color);
+
+  // Return an Image having the given top left coordinate and (width, height)
+  Image subimage(int x, int y, int w, int h);
+
+  // Replace the portion starting at (x, y) with the given image
+  // Clamps the image if it doesn't fit on this canvas
+  void replace(const Image& image, int x, int y);
+
+  // Run a size-preserving Image operator (e.g. blur) over the region
+  // (x, y, w, h) one tile at a time. Each tile is handed to op with halo
+  // extra pixels on every side (at most one tile) so neighborhood operators
+  // see the same input as on the whole canvas
+  void apply(int x, int y, int w, int h,
+      const std::function<Image(const Image&)>& op, int halo = 0);
+
+  // write every changed tile in the cache to the backing file
+  void flush();
+
+  // number of tile accesses served from memory / read from the file
+  uint64_t cacheHits() const;
+  uint64_t cacheMisses() const;
+
+  // whether a read or write of the backing file has failed (reported once
+  // on stdout); tiles that could not be read come back black
+  bool failed() const;
+
+ private:
+  struct Tile {
+    std::vector<Pixel> pixels;  // tileSize x tileSize, row major
+    bool dirty = false;
+    std::list<int>::iterator age;  // position in _lru
+  };
+
+  int _width = 0;
+  int _height = 0;
+  int _tileSize = 0;
+  int _tilesX = 0;
+  int _tilesY = 0;
+  size_t _maxTiles = 0;  // cache budget, in tiles
+  std::fstream _file;
+  std::vector<int64_t> _slots;  // file slot of each tile, -1 if never written
+  int64_t _nextSlot = 0;
+  std::unordered_map<int, Tile> _cache;
+  std::list<int> _lru;  // tile indices, most recently used first
+  int _lastIndex = -1;  // last tile touched, for the fast path
+  Tile* _lastTile = NULL;
+  uint64_t _hits = 0;
+  uint64_t _misses = 0;
+  bool _failed = false;  // see failed()
+
+  // return the tile with the given index, loading it if needed
+  Tile& fetch(int index);
+
+  // note a failed file operation and reset the stream for the next one
+  void reportFailure(const std::string& what);
+
+  // bring a tile into the cache, evicting the oldest ones to stay in budget
+  Tile& load(int index);
+
+  // write a tile to its file slot, allocating one on first write
+  void writeBack(int index, Tile& tile);
+
+  // copy between the canvas and a (w x h) pixel buffer at (x, y), which
+  // must be inside the canvas
+  void copyOut(int x, int y, int w, int h, Pixel* dst, int dstStride);
+  void copyIn(int x, int y, int w, int h, const Pixel* src, int srcStride);
+};
+
+}  // namespace agl
+#endif  // AGL_TILED_IMAGE_H_